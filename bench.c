@@ -0,0 +1,245 @@
+/* nntpsink: dummy NNTP server */
+/*
+ * Copyright (c) 2013-2014 Felicity Tarnell.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * bench: measure how fast charq splits input into lines.  A synthetic stream
+ * is appended to a charq one read-sized piece at a time, as client_read()
+ * would, and after each piece every complete line is taken out again.  The
+ * rate reported includes the copy into the queue.
+ *
+ *   short lines	a streaming feed: CHECK and TAKETHIS commands, and
+ *			article headers and bodies read with cq_read_line()
+ *   bodies		the same feed, with bodies read by cq_discard_body()
+ *   long lines		lines much longer than a read, which showed up the
+ *			cost of rescanning a line on every read
+ */
+
+#include	<sys/types.h>
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<unistd.h>
+#include	<time.h>
+
+#include	"charq.h"
+#include	"nntpsink.h"
+
+#define	BENCH_STREAMSZ	(8 * 1024 * 1024)	/* Synthetic stream size */
+#define	BENCH_LONGLINE	(1024 * 1024)		/* Length of a long line */
+#define	BENCH_READSZ	CHARQ_BSZ		/* Bytes appended at a time */
+#define	BENCH_MINTIME	1.			/* Seconds to run each test */
+
+static char	*stream;
+static size_t	 streamlen;
+
+static double	now(void);
+static void	 append(char const *, size_t);
+static void	 make_feed(void);
+static void	 make_longlines(void);
+static size_t	 run_lines(charq_pool_t *);
+static size_t	 run_bodies(charq_pool_t *);
+static void	 bench(char const *, size_t (*)(charq_pool_t *));
+
+static double
+now()
+{
+struct timespec	ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+append(s, len)
+	char const	*s;
+	size_t		 len;
+{
+	if (streamlen + len > BENCH_STREAMSZ)
+		return;
+	bcopy(s, stream + streamlen, len);
+	streamlen += len;
+}
+
+/*
+ * A streaming feed of articles with typical header lines and bodies of 1 to
+ * 200 lines of 1 to 79 characters, some of them dot-stuffed.
+ */
+static void
+make_feed()
+{
+char		buf[512];
+unsigned	n, i, nlines, len;
+
+	streamlen = 0;
+	srandom(1);
+
+	for (n = 0; streamlen + 32768 < BENCH_STREAMSZ; n++) {
+		len = snprintf(buf, sizeof(buf), "CHECK <%u.%ld@bench.example>\r\n",
+			       n, random());
+		append(buf, len);
+
+		len = snprintf(buf, sizeof(buf),
+			"TAKETHIS <%u@bench.example>\r\n"
+			"Path: news.example.com!feed.example.net!not-for-mail\r\n"
+			"From: Someone <someone@example.org>\r\n"
+			"Newsgroups: alt.test,misc.test\r\n"
+			"Subject: Re: article number %u\r\n"
+			"Date: Mon, 1 Jan 2014 00:00:00 +0000\r\n"
+			"Message-ID: <%u@bench.example>\r\n"
+			"Lines: 42\r\n"
+			"\r\n", n, n, n);
+		append(buf, len);
+
+		nlines = 1 + random() % 200;
+		for (i = 0; i < nlines; i++) {
+			len = 1 + random() % 79;
+			memset(buf, 'a' + i % 26, len);
+			if (random() % 50 == 0)
+				buf[0] = buf[1] = '.';
+			buf[len] = '\r';
+			buf[len + 1] = '\n';
+			append(buf, len + 2);
+		}
+		append(".\r\n", 3);
+	}
+}
+
+static void
+make_longlines()
+{
+	streamlen = 0;
+	while (streamlen + BENCH_LONGLINE <= BENCH_STREAMSZ) {
+		memset(stream + streamlen, 'x', BENCH_LONGLINE - 2);
+		streamlen += BENCH_LONGLINE - 2;
+		append("\r\n", 2);
+	}
+}
+
+/* Split the stream into lines; return the number of bytes processed. */
+static size_t
+run_lines(pool)
+	charq_pool_t	*pool;
+{
+charq_t	*cq = cq_new(pool);
+size_t	 off, len;
+char	*ln;
+
+	for (off = 0; off < streamlen; off += len) {
+		len = streamlen - off > BENCH_READSZ ? BENCH_READSZ : streamlen - off;
+		cq_append(cq, stream + off, len);
+
+		while ((ln = cq_read_line(cq)) != NULL)
+			free(ln);
+	}
+
+	cq_free(cq);
+	return streamlen;
+}
+
+/*
+ * Read commands and headers as lines and bodies with cq_discard_body(), the
+ * way client_process() does.
+ */
+static size_t
+run_bodies(pool)
+	charq_pool_t	*pool;
+{
+charq_t		*cq = cq_new(pool);
+cq_body_t	 body;
+size_t		 off, len, lnlen;
+char		*ln;
+int		 inbody = 0;
+
+	for (off = 0; off < streamlen; off += len) {
+		len = streamlen - off > BENCH_READSZ ? BENCH_READSZ : streamlen - off;
+		cq_append(cq, stream + off, len);
+
+		for (;;) {
+			if (inbody) {
+				if (!cq_discard_body(cq, &body))
+					break;
+				inbody = 0;
+				continue;
+			}
+
+			if ((ln = cq_borrow_line(cq, &lnlen)) == NULL)
+				break;
+			if (lnlen == 0) {
+				cq_body_init(&body);
+				inbody = 1;
+			}
+			cq_release_line(cq);
+		}
+	}
+
+	cq_free(cq);
+	return streamlen;
+}
+
+static void
+bench(name, fn)
+	char const	*name;
+	size_t		(*fn)(charq_pool_t *);
+{
+charq_pool_t	pool;
+double		start, elapsed;
+uint64_t	nbytes = 0;
+
+	cq_pool_init(&pool, 1024, 0);
+
+	start = now();
+	do {
+		nbytes += fn(&pool);
+	} while ((elapsed = now() - start) < BENCH_MINTIME);
+
+	printf("%-12s %8.1f MB/s\n", name, nbytes / elapsed / 1024 / 1024);
+}
+
+int
+main(argc, argv)
+	char	**argv;
+{
+	stream = xmalloc(BENCH_STREAMSZ);
+
+	make_feed();
+	bench("short lines", run_lines);
+	bench("bodies", run_bodies);
+
+	make_longlines();
+	bench("long lines", run_lines);
+
+	return 0;
+}
+
+void *
+xmalloc(sz)
+	size_t	sz;
+{
+void	*ret = malloc(sz);
+	if (!ret) {
+		fprintf(stderr, "out of memory\n");
+		_exit(1);
+	}
+
+	return ret;
+}
+
+void *
+xcalloc(n, sz)
+	size_t	n, sz;
+{
+void	*ret = calloc(n, sz);
+	if (!ret) {
+		fprintf(stderr, "out of memory\n");
+		_exit(1);
+	}
+
+	return ret;
+}
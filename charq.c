@@ -8,9 +8,13 @@
  * warranty.
  */
 
+#include	<sys/types.h>
+#include	<sys/socket.h>
 #include	<sys/uio.h>
+#include	<sys/mman.h>
 
 #include	<stdlib.h>
+#include	<string.h>
 #include	<strings.h>
 #include	<unistd.h>
 #include	<errno.h>
@@ -19,11 +23,154 @@
 #include	"charq.h"
 #include	"nntpsink.h"
 
+#define	cq_ent_get(cq)		cq_pool_get((cq)->cq_pool)
+#define	cq_ent_put(cq, cqe)	cq_pool_put((cq)->cq_pool, (cqe))
+
+void
+cq_pool_init(cqp, max, flags)
+	charq_pool_t	*cqp;
+	size_t		 max;
+{
+	bzero(cqp, sizeof(*cqp));
+	TAILQ_INIT(&cqp->cqp_free);
+	cqp->cqp_max = max;
+	cqp->cqp_flags = flags;
+}
+
+/*
+ * Allocate a new slab of ents and put them on the free list.  Try for real
+ * huge pages first, then transparent huge pages.
+ */
+static int
+cq_pool_slab(cqp)
+	charq_pool_t	*cqp;
+{
+char	*slab = MAP_FAILED;
+size_t	 i;
+
+#ifdef MAP_HUGETLB
+	slab = mmap(NULL, CHARQ_SLABSZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (slab == MAP_FAILED) {
+		slab = mmap(NULL, CHARQ_SLABSZ, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab == MAP_FAILED)
+			return -1;
+#ifdef MADV_HUGEPAGE
+		madvise(slab, CHARQ_SLABSZ, MADV_HUGEPAGE);
+#endif
+	}
+
+	for (i = 0; i + sizeof(charq_ent_t) <= CHARQ_SLABSZ;
+	     i += sizeof(charq_ent_t)) {
+	charq_ent_t	*cqe = (charq_ent_t *) (slab + i);
+		cqe->cqe_flags = CQE_SLAB;
+		TAILQ_INSERT_TAIL(&cqp->cqp_free, cqe, cqe_list);
+		cqp->cqp_nfree++;
+		cqp->cqp_nents++;
+	}
+
+	return 0;
+}
+
+charq_ent_t *
+cq_pool_get(cqp)
+	charq_pool_t	*cqp;
+{
+charq_ent_t	*cqe;
+
+	if (!cqp) {
+		cqe = xmalloc(sizeof(*cqe));
+		cqe->cqe_flags = 0;
+		return cqe;
+	}
+
+	cqp->cqp_nget++;
+	if (cqp->cqp_inuse)
+		__atomic_add_fetch(cqp->cqp_inuse, CHARQ_BSZ, __ATOMIC_RELAXED);
+
+	if (cqe = TAILQ_FIRST(&cqp->cqp_free)) {
+		TAILQ_REMOVE(&cqp->cqp_free, cqe, cqe_list);
+		if (--cqp->cqp_nfree < cqp->cqp_minfree)
+			cqp->cqp_minfree = cqp->cqp_nfree;
+		cqp->cqp_nhit++;
+		return cqe;
+	}
+
+	if ((cqp->cqp_flags & CQP_HUGEPAGE) && cq_pool_slab(cqp) == 0) {
+		cqe = TAILQ_FIRST(&cqp->cqp_free);
+		TAILQ_REMOVE(&cqp->cqp_free, cqe, cqe_list);
+		cqp->cqp_nfree--;
+		return cqe;
+	}
+
+	cqe = xmalloc(sizeof(*cqe));
+	cqe->cqe_flags = 0;
+	cqp->cqp_nents++;
+	return cqe;
+}
+
+void
+cq_pool_put(cqp, cqe)
+	charq_pool_t	*cqp;
+	charq_ent_t	*cqe;
+{
+	if (!cqp) {
+		free(cqe);
+		return;
+	}
+
+	if (cqp->cqp_inuse)
+		__atomic_sub_fetch(cqp->cqp_inuse, CHARQ_BSZ, __ATOMIC_RELAXED);
+
+	if (cqp->cqp_nfree >= cqp->cqp_max && !(cqe->cqe_flags & CQE_SLAB)) {
+		free(cqe);
+		cqp->cqp_nents--;
+		return;
+	}
+
+	/*
+	 * Insert at the head so the next get reuses the block that's most
+	 * likely to still be in cache.
+	 */
+	TAILQ_INSERT_HEAD(&cqp->cqp_free, cqe, cqe_list);
+	cqp->cqp_nfree++;
+}
+
+void
+cq_pool_trim(cqp)
+	charq_pool_t	*cqp;
+{
+charq_ent_t	*cqe, *prev;
+size_t		 n = cqp->cqp_minfree;
+
+	/*
+	 * Ents which stayed free for the whole interval weren't needed; release
+	 * them, oldest first.
+	 */
+	for (cqe = TAILQ_LAST(&cqp->cqp_free, charq_ent_list); cqe && n;
+	     cqe = prev) {
+		prev = TAILQ_PREV(cqe, charq_ent_list, cqe_list);
+		if (cqe->cqe_flags & CQE_SLAB)
+			continue;
+		TAILQ_REMOVE(&cqp->cqp_free, cqe, cqe_list);
+		free(cqe);
+		cqp->cqp_nfree--;
+		cqp->cqp_nents--;
+		n--;
+	}
+
+	cqp->cqp_minfree = cqp->cqp_nfree;
+}
+
 charq_t *
-cq_new()
+cq_new(cqp)
+	charq_pool_t	*cqp;
 {
 charq_t		*cq = xcalloc(1, sizeof(*cq));
 	TAILQ_INIT(&cq->cq_ents);
+	cq->cq_pool = cqp;
 	return cq;
 }
 
@@ -34,11 +181,34 @@ cq_free(cq)
 charq_ent_t	*cqe;
 	while (cqe = TAILQ_FIRST(&cq->cq_ents)) {
 		TAILQ_REMOVE(&cq->cq_ents, cqe, cqe_list);
-		free(cqe);
+		cq_ent_put(cq, cqe);
 	}
+	free(cq->cq_line);
 	free(cq);
 }
 
+/*
+ * Take ents from a different pool from now on.  The queue must be empty; any
+ * ents it's holding on to are returned to the old pool.
+ */
+void
+cq_set_pool(cq, cqp)
+	charq_t		*cq;
+	charq_pool_t	*cqp;
+{
+charq_ent_t	*cqe;
+
+	assert(cq_len(cq) == 0 && cq->cq_borrowed == 0);
+
+	while (cqe = TAILQ_FIRST(&cq->cq_ents)) {
+		TAILQ_REMOVE(&cq->cq_ents, cqe, cqe_list);
+		cq_ent_put(cq, cqe);
+	}
+
+	cq->cq_offs = cq->cq_scan = 0;
+	cq->cq_pool = cqp;
+}
+
 void
 cq_append(cq, data, sz)
 	charq_t		*cq;
@@ -56,7 +226,7 @@ cq_append(cq, data, sz)
 	while (sz) {
 	charq_ent_t	*new;
 	size_t		 todo = sz > CHARQ_BSZ ? CHARQ_BSZ : sz;
-		new = calloc(1, sizeof(*new));
+		new = cq_ent_get(cq);
 		bcopy(data, new->cqe_data, todo);
 		cq->cq_len += todo;
 		sz -= todo;
@@ -65,16 +235,77 @@ cq_append(cq, data, sz)
 	}
 }
 
+/*
+ * Add len bytes of data which the caller has already placed at the start of
+ * cqe's data.  If the queue's last ent is full (or the queue is empty), cqe
+ * itself is linked onto the queue and 1 is returned; the caller must no longer
+ * use it.  Otherwise the data is copied, 0 is returned and the caller keeps
+ * cqe.
+ */
+int
+cq_append_ent(cq, cqe, len)
+	charq_t		*cq;
+	charq_ent_t	*cqe;
+	size_t		 len;
+{
+charq_ent_t	*e;
+
+	if (cq_len(cq) == 0) {
+		while (e = TAILQ_FIRST(&cq->cq_ents)) {
+			TAILQ_REMOVE(&cq->cq_ents, e, cqe_list);
+			cq_ent_put(cq, e);
+		}
+		cq->cq_offs = 0;
+		cq->cq_scan = 0;
+	}
+
+	if (cq_left(cq)) {
+		cq_append(cq, cqe->cqe_data, len);
+		return 0;
+	}
+
+	TAILQ_INSERT_TAIL(&cq->cq_ents, cqe, cqe_list);
+	cq->cq_len += len;
+	return 1;
+}
+
+/*
+ * Return a pointer to len bytes of contiguous free space at the end of the
+ * queue, or NULL if the last ent doesn't have that much room (the caller
+ * should use cq_append() instead).  Once filled in, the data is added to the
+ * queue with cq_commit().
+ */
+char *
+cq_reserve(cq, len)
+	charq_t	*cq;
+	size_t	 len;
+{
+	if (TAILQ_EMPTY(&cq->cq_ents) || cq_left(cq) < len)
+		return NULL;
+	return cq_last_ent_free(cq);
+}
+
+void
+cq_commit(cq, len)
+	charq_t	*cq;
+	size_t	 len;
+{
+	assert(len <= cq_left(cq));
+	cq->cq_len += len;
+}
+
 void
 cq_remove_start(cq, sz)
 	charq_t	*cq;
 	size_t	 sz;
 {
 	assert(sz <= cq_len(cq));
+	cq->cq_scan = sz < cq->cq_scan ? cq->cq_scan - sz : 0;
+
 	while (sz >= (CHARQ_BSZ - cq->cq_offs)) {
 	charq_ent_t	*n = cq_first_ent(cq);
 		TAILQ_REMOVE(&cq->cq_ents, n, cqe_list);
-		free(n);
+		cq_ent_put(cq, n);
 		cq->cq_len -= (CHARQ_BSZ - cq->cq_offs);
 		sz -= (CHARQ_BSZ - cq->cq_offs);
 		cq->cq_offs = 0;
@@ -84,20 +315,54 @@ cq_remove_start(cq, sz)
 	cq->cq_len -= sz;
 }
 
+/*
+ * Fill in up to niov iovecs describing the data at the start of the queue, so
+ * it can be written with a single writev.  Returns the number of iovecs used;
+ * if leftp is not NULL, the number of bytes which didn't fit is stored there.
+ */
+int
+cq_iovec(cq, iov, niov, leftp)
+	charq_t		*cq;
+	struct iovec	*iov;
+	size_t		*leftp;
+{
+charq_ent_t	*e;
+size_t		 left = cq_len(cq);
+int		 n = 0;
+
+	/* The first ent starts at cq_offs; the last is only partly used. */
+	for (e = cq_first_ent(cq); e && left && n < niov;
+	     e = TAILQ_NEXT(e, cqe_list)) {
+	size_t	start = n ? 0 : cq->cq_offs;
+	size_t	len = CHARQ_BSZ - start;
+		if (len > left)
+			len = left;
+		iov[n].iov_base = e->cqe_data + start;
+		iov[n].iov_len = len;
+		left -= len;
+		n++;
+	}
+
+	if (leftp)
+		*leftp = left;
+	return n;
+}
+
 ssize_t
 cq_write(cq, fd)
 	charq_t	*cq;
 {
 ssize_t		i = 0;
-charq_ent_t	*first = cq_first_ent(cq);
 
 	while (cq_len(cq)) {
-	ssize_t	n;
-		first = cq_first_ent(cq);
-		n = write(fd, first->cqe_data + cq->cq_offs, 
-			cq_nents(cq) > 1 
-				? (CHARQ_BSZ - cq->cq_offs)
-				: cq_len(cq));
+	struct iovec	 iov[CHARQ_IOVMAX];
+	int		 niov;
+	ssize_t		 n;
+
+		niov = cq_iovec(cq, iov, CHARQ_IOVMAX, NULL);
+
+		cq->cq_nwrite++;
+		n = writev(fd, iov, niov);
 		if (n <= 0)
 			return n;
 
@@ -133,109 +398,356 @@ charq_ent_t	*first = cq_first_ent(cq);
 	}
 }
 
+/*
+ * Move len bytes from the start of one queue to the end of another.
+ */
+void
+cq_move(to, from, len)
+	charq_t	*to, *from;
+	size_t	 len;
+{
+size_t	n;
+
+	while (len && cq_len(from)) {
+		n = cq_nents(from) > 1
+			? (CHARQ_BSZ - from->cq_offs)
+			: cq_len(from);
+		if (n > len)
+			n = len;
+		cq_append(to, cq_first_ent(from)->cqe_data + from->cq_offs, n);
+		cq_remove_start(from, n);
+		len -= n;
+	}
+}
+
 ssize_t
 cq_read(cq, fd)
 	charq_t	*cq;
 {
-ssize_t	n;	
-	if (cq_left(cq) == 0) {
-	charq_ent_t	*cqe;
-		cqe = xcalloc(1, sizeof(*cqe));
-		n = read(fd, cqe->cqe_data, CHARQ_BSZ);
-		if (n <= 0) {
-			if (n == -1 && errno == EINVAL)
-				abort();
-			free(cqe);
-			return n;
-		}
-		cq->cq_len += n;
-		TAILQ_INSERT_TAIL(&cq->cq_ents, cqe, cqe_list);
+struct iovec	 iov[2];
+charq_ent_t	*cqe;
+ssize_t		 n;	
+size_t		 left = cq_left(cq);
+int		 niov = 0, spare = 0;
+
+	/*
+	 * Read into whatever is left of the last ent, and a fresh ent after it,
+	 * so a nearly-full last ent doesn't limit the size of the read.  The
+	 * fresh ent is only added to the queue if any data landed in it.
+	 *
+	 * Usually the fresh ent is the pool's next free one, which we read
+	 * into where it lies and only take from the pool if the read spilled
+	 * into it, so the pool's statistics only count ents really used.
+	 */
+	if (left) {
+		iov[niov].iov_base = cq_last_ent_free(cq);
+		iov[niov].iov_len = left;
+		niov++;
+	}
+
+	if (cq->cq_pool && (cqe = TAILQ_FIRST(&cq->cq_pool->cqp_free)))
+		spare = 1;
+	else
+		cqe = cq_ent_get(cq);
+	iov[niov].iov_base = cqe->cqe_data;
+	iov[niov].iov_len = CHARQ_BSZ;
+	niov++;
+
+	n = readv(fd, iov, niov);
+	if (n == -1 && errno == EINVAL)
+		abort();
+
+	if (n <= 0 || (size_t) n <= left) {
+		if (!spare)
+			cq_ent_put(cq, cqe);
+		if (n > 0)
+			cq->cq_len += n;
 		return n;
 	}
 
-	n = read(fd, cq_last_ent_free(cq), cq_left(cq));
-			if (n == -1 && errno == EINVAL)
-				abort();
-	if (n > 0)
-		cq->cq_len += n;
+	/* The pool hands out its first free ent, which is the one we used. */
+	if (spare)
+		cqe = cq_ent_get(cq);
+
+	TAILQ_INSERT_TAIL(&cq->cq_ents, cqe, cqe_list);
+	cq->cq_len += n;
 	return n;
 }
 
+/*
+ * Return the offset of the first newline in the queue, or -1 if there isn't
+ * one.  The search starts from cq_scan, which records how much of the queue
+ * we already know doesn't contain a newline, so a long line arriving over
+ * several reads is only scanned once.
+ */
 static ssize_t
-cq_find(cq, c)
+cq_find_eol(cq)
 	charq_t	*cq;
-	char	 c;
 {
-char		*p;
 charq_ent_t	*e;
-size_t		 i = 0, flen;
+size_t		 pos, start, len;
+char		*p;
 
-	if (cq_len(cq) == 0)
+	if (cq->cq_scan >= cq_len(cq))
 		return -1;
-	
-	flen = CHARQ_BSZ - cq->cq_offs;
-	if (flen > cq_len(cq))
-		flen = cq_len(cq);
-
-	for (e = cq_first_ent(cq), p = e->cqe_data + cq->cq_offs;
-	     p < (e->cqe_data + cq->cq_offs + flen); p++) {
-		if (*p == c)
-			return p - (e->cqe_data + cq->cq_offs);
-	}
-	i = CHARQ_BSZ - cq->cq_offs;
-	for (e = TAILQ_NEXT(e, cqe_list); e; e = TAILQ_NEXT(e, cqe_list)) {
-		for (p = e->cqe_data; i < cq->cq_len && p < (e->cqe_data + CHARQ_BSZ); p++, i++) {
-			if (*p == c) {
-				return i;
+
+	/* Find the ent containing the first unscanned byte. */
+	pos = cq->cq_offs + cq->cq_scan;
+	for (e = cq_first_ent(cq); pos >= CHARQ_BSZ; e = TAILQ_NEXT(e, cqe_list))
+		pos -= CHARQ_BSZ;
+
+	for (; e && cq->cq_scan < cq_len(cq); e = TAILQ_NEXT(e, cqe_list)) {
+		start = pos;
+		len = CHARQ_BSZ - start;
+		if (len > cq_len(cq) - cq->cq_scan)
+			len = cq_len(cq) - cq->cq_scan;
+
+		if (p = memchr(e->cqe_data + start, '\n', len))
+			return cq->cq_scan + (p - (e->cqe_data + start));
+
+		cq->cq_scan += len;
+		pos = 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Body scanner states: CQB_TEXT is anywhere in a line; CQB_DOT means we've
+ * seen a "." at the start of a line, and CQB_DOTCR a "." followed by CR.
+ */
+#define	CQB_TEXT	0
+#define	CQB_DOT		1
+#define	CQB_DOTCR	2
+
+void
+cq_body_init(cqb)
+	cq_body_t	*cqb;
+{
+	cqb->cqb_state = CQB_TEXT;
+	cqb->cqb_last = '\n';	/* The body starts at the start of a line */
+	cqb->cqb_len = 0;
+	cqb->cqb_maxline = 0;
+	cqb->cqb_nlines = 0;
+	cqb->cqb_termlen = 0;
+	cqb->cqb_linelen = 0;
+	cqb->cqb_toolong = 0;
+	cqb->cqb_save = NULL;
+	cqb->cqb_udata = NULL;
+}
+
+/*
+ * Count the lines in buf, and if cqb_maxline is set, check their lengths
+ * against it.  Lengths include the line ending.  This is a second pass over
+ * the data, but only a memchr() per line.
+ */
+static void
+cq_body_lines(cqb, buf, len)
+	cq_body_t	*cqb;
+	char const	*buf;
+	size_t		 len;
+{
+char const	*p = buf, *end = buf + len, *q;
+
+	if (cqb->cqb_maxline == 0) {
+		while (q = memchr(p, '\n', end - p)) {
+			cqb->cqb_nlines++;
+			p = q + 1;
+		}
+		return;
+	}
+
+	while (q = memchr(p, '\n', end - p)) {
+		if (cqb->cqb_linelen + (q - p) + 1 > cqb->cqb_maxline)
+			cqb->cqb_toolong = 1;
+		cqb->cqb_linelen = 0;
+		cqb->cqb_nlines++;
+		p = q + 1;
+	}
+
+	cqb->cqb_linelen += end - p;
+	if (cqb->cqb_linelen > cqb->cqb_maxline)
+		cqb->cqb_toolong = 1;
+}
+
+/*
+ * Rather than looking at every line, we use memchr() to skip to the next ".",
+ * then check whether it starts a line.
+ */
+ssize_t
+cq_scan_body(cqb, buf, len)
+	cq_body_t	*cqb;
+	char const	*buf;
+	size_t		 len;
+{
+char const	*p = buf, *end = buf + len, *q;
+
+	while (p < end) {
+		switch (cqb->cqb_state) {
+		case CQB_TEXT:
+			if ((q = memchr(p, '.', end - p)) == NULL) {
+				p = end;
+				break;
 			}
+
+			if ((q == buf ? cqb->cqb_last : q[-1]) == '\n')
+				cqb->cqb_state = CQB_DOT;
+			p = q + 1;
+			break;
+
+		case CQB_DOT:
+		case CQB_DOTCR:
+			if (*p == '\n') {
+				cqb->cqb_termlen = cqb->cqb_state == CQB_DOTCR ? 3 : 2;
+				cqb->cqb_state = CQB_TEXT;
+				cqb->cqb_last = '\n';
+				cq_body_lines(cqb, buf, p + 1 - buf);
+				if (cqb->cqb_save)
+					cqb->cqb_save(cqb->cqb_udata, buf, p + 1 - buf);
+				return p + 1 - buf;
+			}
+
+			if (*p == '\r' && cqb->cqb_state == CQB_DOT)
+				cqb->cqb_state = CQB_DOTCR;
+			else
+				cqb->cqb_state = CQB_TEXT;
+			p++;
+			break;
 		}
 	}
+
+	cq_body_lines(cqb, buf, len);
+	if (cqb->cqb_save && len)
+		cqb->cqb_save(cqb->cqb_udata, buf, len);
+	if (len)
+		cqb->cqb_last = end[-1];
 	return -1;
 }
 
+int
+cq_discard_body(cq, cqb)
+	charq_t		*cq;
+	cq_body_t	*cqb;
+{
+charq_ent_t	*e;
+size_t		 done = 0, start, len;
+ssize_t		 n;
+
+	start = cq->cq_offs;
+	for (e = cq_first_ent(cq); e && done < cq_len(cq);
+	     e = TAILQ_NEXT(e, cqe_list)) {
+		len = CHARQ_BSZ - start;
+		if (len > cq_len(cq) - done)
+			len = cq_len(cq) - done;
+
+		if ((n = cq_scan_body(cqb, e->cqe_data + start, len)) != -1) {
+			cqb->cqb_len += n;
+			cq_remove_start(cq, done + n);
+			return 1;
+		}
+
+		done += len;
+		start = 0;
+	}
+
+	cqb->cqb_len += done;
+	cq_remove_start(cq, done);
+	return 0;
+}
+
+/*
+ * Discard data up to and including the next newline.  Returns 1 if a newline
+ * was found, otherwise discards everything in the queue and returns 0.
+ */
+int
+cq_discard_line(cq)
+	charq_t	*cq;
+{
+ssize_t	pos;
+
+	assert(cq->cq_borrowed == 0);
+
+	if ((pos = cq_find_eol(cq)) == -1) {
+		cq_remove_start(cq, cq_len(cq));
+		return 0;
+	}
+
+	cq_remove_start(cq, pos + 1);
+	return 1;
+}
+
+/*
+ * Return the next line in the queue, with the trailing CRLF or LF removed and
+ * NUL terminated, and store its length in *lenp.  If the line lies within a
+ * single ent it's returned in place, without copying; otherwise it's copied
+ * into cq_line, which is kept for the next line that needs it.  Either way the
+ * line remains valid, and in the queue, until cq_release_line() is called.
+ * Returns NULL if there is no complete line.
+ */
 char *
-cq_read_line(cq)
+cq_borrow_line(cq, lenp)
 	charq_t	*cq;
+	size_t	*lenp;
 {
 charq_ent_t	*e;
 ssize_t		 pos;
 char		*line;
-size_t		 done = 0, todo;
+size_t		 done, todo;
 
-	if ((pos = cq_find(cq, '\n')) == -1)
+	assert(cq->cq_borrowed == 0);
+
+	if ((pos = cq_find_eol(cq)) == -1)
 		return NULL;
-	pos++;
-	line = xmalloc(pos + 1);
+	cq->cq_borrowed = pos + 1;
 
 	e = cq_first_ent(cq);
-	todo = pos <= (CHARQ_BSZ - cq->cq_offs) ?
-		pos : (CHARQ_BSZ - cq->cq_offs);
-	assert(todo <= pos);
-	bcopy(e->cqe_data + cq->cq_offs, line, todo);
-	done += todo;
-
-	if (done == pos) {
-		line[done - 1] = 0;
-		if (*line && line[done - 2] == '\r')
-			line[done - 2] = 0;
-		cq_remove_start(cq, pos);
-		return line;
-	}
-
-	for (e = TAILQ_NEXT(e, cqe_list); e; e = TAILQ_NEXT(e, cqe_list)) {
-		todo = pos <= CHARQ_BSZ ?  pos : CHARQ_BSZ;
-		if (todo > (pos - done))
-			todo = pos - done;
-		bcopy(e->cqe_data, line + done, todo);
-		done += todo;
-		if (done == pos) {
-			line[done - 1] = 0;
-			if (*line && line[done - 2] == '\r')
-				line[done - 2] = 0;
-			cq_remove_start(cq, pos);
-			return line;
+	if (cq->cq_offs + pos < CHARQ_BSZ) {
+		line = e->cqe_data + cq->cq_offs;
+	} else {
+		if (cq->cq_linesz < (size_t) pos + 1) {
+			free(cq->cq_line);
+			cq->cq_linesz = pos + 1;
+			cq->cq_line = xmalloc(cq->cq_linesz);
+		}
+
+		line = cq->cq_line;
+		todo = CHARQ_BSZ - cq->cq_offs;
+		bcopy(e->cqe_data + cq->cq_offs, line, todo);
+		for (done = todo; done < pos; done += todo) {
+			e = TAILQ_NEXT(e, cqe_list);
+			todo = pos - done > CHARQ_BSZ ? CHARQ_BSZ : pos - done;
+			bcopy(e->cqe_data, line + done, todo);
 		}
 	}
 
-	abort();
+	if (pos && line[pos - 1] == '\r')
+		pos--;
+	line[pos] = 0;
+
+	*lenp = pos;
+	return line;
+}
+
+void
+cq_release_line(cq)
+	charq_t	*cq;
+{
+	cq_remove_start(cq, cq->cq_borrowed);
+	cq->cq_borrowed = 0;
+}
+
+char *
+cq_read_line(cq)
+	charq_t	*cq;
+{
+char	*ln, *line;
+size_t	 len;
+
+	if ((ln = cq_borrow_line(cq, &len)) == NULL)
+		return NULL;
+
+	line = xmalloc(len + 1);
+	bcopy(ln, line, len + 1);
+	cq_release_line(cq);
+	return line;
 }
@@ -12,6 +12,9 @@
 #define	NTS_CHARQ_H
 
 #include	<sys/types.h>
+#include	<sys/uio.h>
+
+#include	<stdint.h>
 
 #include	"queue.h"
 
@@ -24,18 +27,59 @@
  */
 
 #define	CHARQ_BSZ	16384
+#define	CHARQ_IOVMAX	64	/* Max. ents to write in one syscall */
 
 typedef struct charq_ent {
 	TAILQ_ENTRY(charq_ent)	cqe_list;
+	int			cqe_flags;
 	char			cqe_data[CHARQ_BSZ];
 } charq_ent_t;
 
+#define	CQE_SLAB	0x1	/* Ent is part of a slab, never free() it */
+
 typedef TAILQ_HEAD(charq_ent_list, charq_ent) charq_ent_list_t;
 
+/*
+ * A charq_pool caches free ents so that a busy charq doesn't have to go to
+ * malloc for every block.  A pool is not locked; it, and every charq that uses
+ * it, must only be used by one thread at a time.  Up to cqp_max free ents are
+ * kept; past that, released ents are returned to the system.
+ *
+ * With CQP_HUGEPAGE, ents are carved from 2MB slabs backed by huge pages where
+ * the system allows it.  Slab ents can't be returned individually, so they are
+ * always kept on the free list regardless of cqp_max.
+ *
+ * cq_pool_trim() should be called periodically; it releases free ents which
+ * weren't needed since the last trim, so an idle pool shrinks over time.
+ */
+typedef struct charq_pool {
+	charq_ent_list_t cqp_free;	/* Free ents */
+	size_t		 cqp_nfree;	/* Number of free ents */
+	size_t		 cqp_max;	/* Free ents to keep (high-water mark) */
+	size_t		 cqp_nents;	/* Ents owned by the pool, free or not */
+	size_t		 cqp_minfree;	/* Lowest cqp_nfree since last trim */
+	int		 cqp_flags;
+
+	size_t		*cqp_inuse;	/* If set, bytes in use, shared between pools */
+
+	uint64_t	 cqp_nget;	/* Ents handed out */
+	uint64_t	 cqp_nhit;	/* ... of which came from the free list */
+} charq_pool_t;
+
+#define	CQP_HUGEPAGE	0x1
+
+#define	CHARQ_SLABSZ	(2 * 1024 * 1024)
+
 typedef struct charq {
 	size_t		 cq_len;	/* Amount of data in q */
 	size_t		 cq_offs;	/* Unused space in the first ent */
 	charq_ent_list_t cq_ents;	/* List of ents */
+	charq_pool_t	*cq_pool;	/* Where our ents come from */
+	size_t		 cq_scan;	/* Bytes known not to contain a newline */
+	size_t		 cq_borrowed;	/* Length of the borrowed line, if any */
+	char		*cq_line;	/* Buffer for lines spanning ents */
+	size_t		 cq_linesz;
+	size_t		 cq_nwrite;	/* Number of write calls made */
 } charq_t;
 
 #define	cq_len(cq)		((cq)->cq_len)
@@ -48,16 +92,66 @@ typedef struct charq {
 
 void	 cq_init(void);
 
-charq_t	*cq_new(void);
+void	 cq_pool_init(charq_pool_t *, size_t max, int flags);
+void	 cq_pool_trim(charq_pool_t *);
+charq_ent_t *cq_pool_get(charq_pool_t *);
+void	 cq_pool_put(charq_pool_t *, charq_ent_t *);
+#define	cq_pool_size(cqp)	((cqp)->cqp_nents * sizeof(charq_ent_t))
+
+charq_t	*cq_new(charq_pool_t *);
 void	 cq_free(charq_t *);
+void	 cq_set_pool(charq_t *, charq_pool_t *);
 
+int	 cq_iovec(charq_t *, struct iovec *, int, size_t *);
 ssize_t	 cq_write(charq_t *, int);
 ssize_t	 cq_read(charq_t *, int);
+/* How much cq_read() will try to read; a shorter read drained the socket. */
+#define	cq_read_size(cq)	(cq_left(cq) + CHARQ_BSZ)
 
 void	 cq_append(charq_t *, char const *, size_t);
+int	 cq_append_ent(charq_t *, charq_ent_t *, size_t);
+char	*cq_reserve(charq_t *, size_t);
+void	 cq_commit(charq_t *, size_t);
 void	 cq_remove_start(charq_t *, size_t);
 void	 cq_extract_start(charq_t *, void *buf, size_t);
+void	 cq_move(charq_t *to, charq_t *from, size_t);
+
+/*
+ * Article body scanning: cq_discard_body() consumes data from the queue until
+ * it finds the terminating "." line, without splitting the body into lines.
+ * State is kept in a cq_body_t across calls, so the terminator can be split
+ * across reads.  Returns 1 if the terminator was found and consumed (any data
+ * following it is left in the queue), otherwise 0, in which case everything
+ * in the queue has been consumed.
+ */
+typedef struct cq_body {
+	int	cqb_state;
+	char	cqb_last;	/* Last byte seen */
+	size_t	cqb_len;	/* Bytes consumed so far */
+	size_t	cqb_maxline;	/* If set, flag lines longer than this */
+	size_t	cqb_linelen;	/* Length of the current line so far */
+	int	cqb_toolong;	/* A line was longer than cqb_maxline */
+	size_t	cqb_nlines;	/* Lines so far, including the terminator */
+	int	cqb_termlen;	/* Length of the terminator, once found */
+
+	/* If set, called with each piece of the body as it's scanned. */
+	void	(*cqb_save)(void *udata, char const *, size_t);
+	void	 *cqb_udata;
+} cq_body_t;
+
+void	  cq_body_init(cq_body_t *);
+int	  cq_discard_body(charq_t *, cq_body_t *);
+
+/*
+ * The scanner used by cq_discard_body(), for data that isn't in a charq: scan
+ * buf for the end of the body, and return the offset just past the terminator,
+ * or -1 if it's not in buf.  Doesn't update cqb_len.
+ */
+ssize_t	  cq_scan_body(cq_body_t *, char const *, size_t);
 
 char	 *cq_read_line(charq_t *);
+int	  cq_discard_line(charq_t *);
+char	 *cq_borrow_line(charq_t *, size_t *);
+void	  cq_release_line(charq_t *);
 
 #endif	/* !NTS_CHARQ_H */
@@ -0,0 +1,159 @@
+/* nntpsink: dummy NNTP server */
+/*
+ * Copyright (c) 2013-2014 Felicity Tarnell.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#include	<sys/types.h>
+
+#include	<strings.h>
+
+#include	"histogram.h"
+#include	"nntpsink.h"
+
+static unsigned
+hg_bucket(v)
+	uint64_t	v;
+{
+unsigned	e;
+
+	if (v < HG_SUB)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	return (e - HG_SUBBITS + 1) * HG_SUB
+		+ ((v >> (e - HG_SUBBITS)) & (HG_SUB - 1));
+}
+
+/* The largest value that goes in bucket i. */
+static uint64_t
+hg_bucket_max(i)
+	unsigned	i;
+{
+unsigned	e, sub;
+
+	if (i < HG_SUB)
+		return i;
+
+	e = i / HG_SUB + HG_SUBBITS - 1;
+	sub = i % HG_SUB;
+	return ((uint64_t) (HG_SUB + sub + 1) << (e - HG_SUBBITS)) - 1;
+}
+
+void
+hg_add(hg, v)
+	histogram_t	*hg;
+	uint64_t	 v;
+{
+	hg->hg_buckets[hg_bucket(v)]++;
+	hg->hg_count++;
+	if (v > hg->hg_max)
+		hg->hg_max = v;
+}
+
+void
+hg_merge(to, from)
+	histogram_t		*to;
+	histogram_t const	*from;
+{
+unsigned	i;
+
+	if (from->hg_count == 0)
+		return;
+
+	for (i = 0; i < HG_NBUCKETS; i++)
+		to->hg_buckets[i] += from->hg_buckets[i];
+	to->hg_count += from->hg_count;
+	if (from->hg_max > to->hg_max)
+		to->hg_max = from->hg_max;
+}
+
+void
+hg_reset(hg)
+	histogram_t	*hg;
+{
+	bzero(hg, sizeof(*hg));
+}
+
+/* Subtract from's counts from to's; to's hg_max is kept. */
+void
+hg_sub(to, from)
+	histogram_t		*to;
+	histogram_t const	*from;
+{
+unsigned	i;
+
+	for (i = 0; i < HG_NBUCKETS; i++)
+		to->hg_buckets[i] -= from->hg_buckets[i];
+	to->hg_count -= from->hg_count;
+}
+
+/* Only one thread may publish to a histogram. */
+void
+hg_publish(shared, from)
+	histogram_t		*shared;
+	histogram_t const	*from;
+{
+uint64_t	max;
+unsigned	i;
+
+	if (from->hg_count == 0)
+		return;
+
+	for (i = 0; i < HG_NBUCKETS; i++)
+		if (from->hg_buckets[i])
+			counter_add(&shared->hg_buckets[i], from->hg_buckets[i]);
+	counter_add(&shared->hg_count, from->hg_count);
+
+	/* hg_collect() may clear this at any time. */
+	max = load_relaxed(&shared->hg_max);
+	while (from->hg_max > max
+	       && !__atomic_compare_exchange_n(&shared->hg_max, &max, from->hg_max,
+					      1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void
+hg_collect(to, shared)
+	histogram_t	*to, *shared;
+{
+uint64_t	max;
+unsigned	i;
+
+	for (i = 0; i < HG_NBUCKETS; i++)
+		to->hg_buckets[i] += load_relaxed(&shared->hg_buckets[i]);
+	to->hg_count += load_relaxed(&shared->hg_count);
+
+	max = __atomic_exchange_n(&shared->hg_max, 0, __ATOMIC_RELAXED);
+	if (max > to->hg_max)
+		to->hg_max = max;
+}
+
+uint64_t
+hg_percentile(hg, pct)
+	histogram_t const	*hg;
+	double			 pct;
+{
+uint64_t	want, seen = 0, v;
+unsigned	i;
+
+	if (hg->hg_count == 0)
+		return 0;
+
+	want = hg->hg_count * pct / 100;
+	if (want == 0)
+		want = 1;
+
+	for (i = 0; i < HG_NBUCKETS; i++) {
+		if ((seen += hg->hg_buckets[i]) >= want) {
+			v = hg_bucket_max(i);
+			return v < hg->hg_max ? v : hg->hg_max;
+		}
+	}
+
+	return hg->hg_max;
+}
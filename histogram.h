@@ -0,0 +1,52 @@
+/* nntpsink: dummy NNTP server */
+/*
+ * Copyright (c) 2013-2014 Felicity Tarnell.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#ifndef	NNTPSINK_HISTOGRAM_H
+#define	NNTPSINK_HISTOGRAM_H
+
+#include	<sys/types.h>
+#include	<stdint.h>
+
+/*
+ * A log-bucketed histogram of unsigned values: each power of 2 is split into
+ * HG_SUB buckets, so a value is placed to within 25% and a histogram is a
+ * fixed, small array that's cheap to add to and to merge.  Values below
+ * HG_SUB have a bucket each.  It isn't locked; each thread keeps its own and
+ * they're merged for reporting.
+ *
+ * To report without a lock, a thread hg_publish()es what it's collected into
+ * a second histogram whose counts only ever grow, and the reporting thread
+ * hg_collect()s that into a total; the difference between two totals, from
+ * hg_sub(), is what was added in between.  hg_max of a published histogram is
+ * the largest value since the last hg_collect(), which clears it.
+ */
+
+#define	HG_SUBBITS	2
+#define	HG_SUB		(1 << HG_SUBBITS)
+#define	HG_NBUCKETS	((64 - HG_SUBBITS + 1) * HG_SUB)
+
+typedef struct histogram {
+	uint64_t	hg_count;
+	uint64_t	hg_max;
+	uint64_t	hg_buckets[HG_NBUCKETS];
+} histogram_t;
+
+void		hg_add(histogram_t *, uint64_t);
+void		hg_merge(histogram_t *to, histogram_t const *from);
+void		hg_reset(histogram_t *);
+void		hg_sub(histogram_t *to, histogram_t const *from);
+
+void		hg_publish(histogram_t *shared, histogram_t const *from);
+void		hg_collect(histogram_t *to, histogram_t *shared);
+
+/* The value below which pct percent of values fall, to within a bucket. */
+uint64_t	hg_percentile(histogram_t const *, double pct);
+
+#endif	/* !NNTPSINK_HISTOGRAM_H */
@@ -0,0 +1,310 @@
+/* nntpsink: dummy NNTP server */
+/*
+ * Copyright (c) 2013-2014 Felicity Tarnell.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#include	<sys/types.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<unistd.h>
+#include	<fcntl.h>
+#include	<errno.h>
+
+#include	"history.h"
+#include	"nntpsink.h"
+
+#define	HIST_TBITS	24
+#define	HIST_TMASK	((1ULL << HIST_TBITS) - 1)
+
+#define	hist_bucket(h, hash)	(&(h)->hi_slots[((hash) & ((h)->hi_nbuckets - 1)) * HIST_BUCKET])
+#define	hist_fp(hash)		((hash) >> HIST_TBITS)
+#define	hist_age(slot, now)	(((uint64_t) (now) - (slot)) & HIST_TMASK)
+#define	hist_expired(h, slot, now) \
+	((h)->hi_expire && hist_age((slot), (now)) >= (h)->hi_expire)
+
+static size_t
+hist_nbuckets(size)
+	size_t	size;
+{
+size_t	n = 1;
+
+	while (n * 2 * HIST_BUCKET * sizeof(uint64_t) <= size)
+		n *= 2;
+	return n;
+}
+
+/*
+ * Create a table using size bytes (rounded down to a power of 2 buckets).
+ * Like charq slabs, it's mapped with huge pages if we can get them, since
+ * lookups are spread over the whole table.
+ */
+history_t *
+hist_new(size, expire)
+	size_t		size;
+	unsigned	expire;
+{
+history_t	*h = xcalloc(1, sizeof(*h));
+void		*p = MAP_FAILED;
+
+	h->hi_fd = -1;
+	h->hi_expire = expire;
+	h->hi_nbuckets = hist_nbuckets(size);
+	h->hi_size = h->hi_nbuckets * HIST_BUCKET * sizeof(uint64_t);
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, h->hi_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, h->hi_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			free(h);
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(p, h->hi_size, MADV_HUGEPAGE);
+#endif
+	}
+
+	h->hi_slots = p;
+	h->hi_map = p;
+	h->hi_mapsz = h->hi_size;
+	return h;
+}
+
+/*
+ * Open the history file at path, creating it with a table of size bytes if it
+ * doesn't exist and size isn't 0.  An existing file keeps the size it was
+ * created with.  The slots aren't read here; a new file is sparse, and empty
+ * slots are zero.
+ */
+history_t *
+hist_open(path, size, expire)
+	char const	*path;
+	size_t		 size;
+	unsigned	 expire;
+{
+history_t		*h = xcalloc(1, sizeof(*h));
+struct hist_header	 hdr;
+struct stat		 sb;
+time_t			 now = time(NULL);
+int			 save;
+
+	h->hi_expire = expire;
+	h->hi_map = MAP_FAILED;
+
+	if ((h->hi_fd = open(path, O_RDWR | O_CLOEXEC | (size ? O_CREAT : 0),
+			     0644)) == -1)
+		goto err;
+
+	if (fstat(h->hi_fd, &sb) == -1)
+		goto err;
+
+	if (sb.st_size == 0) {
+		if (size == 0) {
+			errno = EINVAL;
+			goto err;
+		}
+
+		bzero(&hdr, sizeof(hdr));
+		bcopy(HIST_MAGIC, hdr.hh_magic, sizeof(hdr.hh_magic));
+		hdr.hh_bucket = HIST_BUCKET;
+		hdr.hh_nbuckets = hist_nbuckets(size);
+		hdr.hh_time = now;
+
+		if (ftruncate(h->hi_fd, HIST_HDRSZ
+			      + hdr.hh_nbuckets * HIST_BUCKET * sizeof(uint64_t)) == -1)
+			goto err;
+		if (pwrite(h->hi_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			goto err;
+	} else {
+		if (pread(h->hi_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+		    || memcmp(hdr.hh_magic, HIST_MAGIC, sizeof(hdr.hh_magic))
+		    || hdr.hh_bucket != HIST_BUCKET
+		    || hdr.hh_nbuckets == 0
+		    || (hdr.hh_nbuckets & (hdr.hh_nbuckets - 1))
+		    || (uint64_t) sb.st_size != HIST_HDRSZ
+			+ hdr.hh_nbuckets * HIST_BUCKET * sizeof(uint64_t)) {
+			errno = EINVAL;
+			goto err;
+		}
+
+		/*
+		 * If everything has expired since the last sync, empty the
+		 * table by truncating the slots away.
+		 */
+		if (expire && (uint64_t) now - hdr.hh_time >= expire
+		    && (ftruncate(h->hi_fd, HIST_HDRSZ) == -1
+			|| ftruncate(h->hi_fd, sb.st_size) == -1))
+			goto err;
+	}
+
+	h->hi_nbuckets = hdr.hh_nbuckets;
+	h->hi_size = h->hi_nbuckets * HIST_BUCKET * sizeof(uint64_t);
+	h->hi_mapsz = HIST_HDRSZ + h->hi_size;
+
+	h->hi_map = mmap(NULL, h->hi_mapsz, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 h->hi_fd, 0);
+	if (h->hi_map == MAP_FAILED)
+		goto err;
+
+	h->hi_slots = (uint64_t *) ((char *) h->hi_map + HIST_HDRSZ);
+	return h;
+
+err:
+	save = errno;
+	if (h->hi_fd != -1)
+		close(h->hi_fd);
+	free(h);
+	errno = save;
+	return NULL;
+}
+
+/*
+ * Write the table back to the history file, if there is one.
+ */
+int
+hist_sync(h)
+	history_t	*h;
+{
+struct hist_header	*hdr = h->hi_map;
+
+	if (h->hi_fd == -1)
+		return 0;
+
+	store_relaxed(&hdr->hh_time, (uint64_t) time(NULL));
+	if (msync(h->hi_map, h->hi_mapsz, MS_ASYNC) == -1)
+		return -1;
+#ifdef	HAVE_FDATASYNC
+	return fdatasync(h->hi_fd);
+#else
+	return fsync(h->hi_fd);
+#endif
+}
+
+/*
+ * Empty every slot that has expired.  This takes a while for a large table,
+ * so it should have a thread of its own.
+ */
+void
+hist_expire(h, now)
+	history_t	*h;
+	time_t		 now;
+{
+uint64_t	slot;
+size_t		i;
+
+	if (h->hi_expire == 0)
+		return;
+
+	for (i = 0; i < h->hi_nbuckets * HIST_BUCKET; i++) {
+		slot = load_relaxed(&h->hi_slots[i]);
+		if (slot && hist_expired(h, slot, now))
+			__atomic_compare_exchange_n(&h->hi_slots[i], &slot, 0, 0,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * FNV-1a, with a final mix so the fingerprint and bucket bits are both well
+ * distributed.
+ */
+uint64_t
+hist_hash(s, len)
+	char const	*s;
+	size_t		 len;
+{
+uint64_t	h = 0xCBF29CE484222325ULL;
+
+	while (len--)
+		h = (h ^ (unsigned char) *s++) * 0x100000001B3ULL;
+
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+
+	/* 0 is an empty slot. */
+	if (hist_fp(h) == 0)
+		h |= 1ULL << HIST_TBITS;
+	return h;
+}
+
+/*
+ * Return 1 if the message-ID with this hash is in the history.
+ */
+int
+hist_check(h, hash, now)
+	history_t	*h;
+	uint64_t	 hash;
+	time_t		 now;
+{
+uint64_t	*b = hist_bucket(h, hash), slot;
+int		 i;
+
+	for (i = 0; i < HIST_BUCKET; i++) {
+		slot = load_relaxed(&b[i]);
+		if (slot && (slot >> HIST_TBITS) == hist_fp(hash)
+		    && !hist_expired(h, slot, now))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Add the message-ID with this hash to the history.  Returns 1 if it was
+ * already there, otherwise 0.
+ */
+int
+hist_add(h, hash, now)
+	history_t	*h;
+	uint64_t	 hash;
+	time_t		 now;
+{
+uint64_t	*b = hist_bucket(h, hash), slot, vslot = 0, new, age, maxage;
+int		 i, victim;
+
+	new = (hist_fp(hash) << HIST_TBITS) | ((uint64_t) now & HIST_TMASK);
+
+	for (;;) {
+		/*
+		 * Replace the first free slot, or failing that the oldest, but
+		 * look at the whole bucket first in case it's already here.
+		 */
+		victim = -1;
+		maxage = 0;
+		for (i = 0; i < HIST_BUCKET; i++) {
+			slot = load_relaxed(&b[i]);
+
+			if (slot && !hist_expired(h, slot, now)) {
+				if ((slot >> HIST_TBITS) == hist_fp(hash))
+					return 1;
+				age = hist_age(slot, now);
+			} else
+				age = HIST_TMASK + 1;	/* Older than anything */
+
+			if (victim == -1 || age > maxage) {
+				victim = i;
+				vslot = slot;
+				maxage = age;
+			}
+		}
+
+		/* If someone else changed it since we looked, start again. */
+		if (__atomic_compare_exchange_n(&b[victim], &vslot, new, 0,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return 0;
+	}
+}
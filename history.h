@@ -0,0 +1,87 @@
+/* nntpsink: dummy NNTP server */
+/*
+ * Copyright (c) 2013-2014 Felicity Tarnell.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#ifndef	NNTPSINK_HISTORY_H
+#define	NNTPSINK_HISTORY_H
+
+#include	<sys/types.h>
+#include	<stdint.h>
+#include	<time.h>
+
+/*
+ * Message-ID history.  The table is a fixed-size array of buckets, each one
+ * cache line of HIST_BUCKET slots.  A slot holds a 40-bit fingerprint of the
+ * message-ID and the low 24 bits of the time it was added, or 0 if it's empty;
+ * the bucket comes from other bits of the same hash.  When a bucket is full,
+ * the oldest entry is replaced, so the table never grows; entries older than
+ * the expiry time are treated as empty.
+ *
+ * All threads share one table without locking: slots are read and replaced
+ * with atomic operations.  Two threads adding the same message-ID at the same
+ * time may both be told it's new.
+ *
+ * Since slots only hold 24 bits of the time, an entry older than about 194
+ * days would look new again; hist_expire() should be called every HIST_SWEEP
+ * seconds to empty expired slots before that can happen.
+ *
+ * The table can be kept in a file, which is simply a header page followed by
+ * the slots, and is mapped shared and updated in place.  Since slots hold the
+ * time in seconds since the epoch, opening an existing file takes the same
+ * time whatever its size, and it's valid as soon as it's mapped.  Changes
+ * reach the file as the kernel writes back the mapping, or when hist_sync()
+ * is called; a crash of the process loses nothing, a crash of the system
+ * loses what was added since the last sync.  The header records when the
+ * file was last synced; if every entry has expired since then, the table is
+ * emptied when it's opened, rather than trusting times that may have wrapped.
+ */
+
+#define	HIST_BUCKET	8
+
+typedef struct history {
+	uint64_t	*hi_slots;
+	size_t		 hi_nbuckets;	/* Power of 2 */
+	size_t		 hi_size;	/* Size of hi_slots */
+	unsigned	 hi_expire;	/* Seconds; 0 is never */
+
+	int		 hi_fd;		/* History file, or -1 */
+	void		*hi_map;	/* The whole file mapping */
+	size_t		 hi_mapsz;
+} history_t;
+
+/* The first page of a history file. */
+#define	HIST_MAGIC	"NSHIST01"
+#define	HIST_HDRSZ	4096
+
+struct hist_header {
+	char		hh_magic[8];
+	uint32_t	hh_bucket;	/* HIST_BUCKET */
+	uint32_t	hh_pad;
+	uint64_t	hh_nbuckets;
+	uint64_t	hh_time;	/* Last hist_sync() */
+};
+
+#define	HIST_SWEEP	(24 * 60 * 60)
+
+/*
+ * The most we can expire after.  An entry can be up to twice this plus two
+ * sweeps old before it's emptied (if the file was closed just before a sweep
+ * and opened again just before it expired), and that must fit in 24 bits.
+ */
+#define	HIST_MAXEXPIRE	(((1 << 24) - 2 * HIST_SWEEP) / 2)
+
+history_t	*hist_new(size_t size, unsigned expire);
+history_t	*hist_open(char const *path, size_t size, unsigned expire);
+int		 hist_sync(history_t *);
+void		 hist_expire(history_t *, time_t now);
+uint64_t	 hist_hash(char const *, size_t);
+int		 hist_check(history_t *, uint64_t hash, time_t now);
+int		 hist_add(history_t *, uint64_t hash, time_t now);
+
+#endif	/* !NNTPSINK_HISTORY_H */
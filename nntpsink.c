@@ -8,6 +8,8 @@
  * warranty.
  */
 
+#define	_GNU_SOURCE	/* accept4, CPU_SET */
+
 #include	<sys/types.h>
 #include	<sys/socket.h>
 #include	<sys/resource.h>
@@ -15,6 +17,10 @@
 #include	<netinet/in.h>
 #include	<netinet/tcp.h>
 
+#ifdef	__linux__
+# include	<linux/filter.h>
+#endif
+
 #include	<stdlib.h>
 #include	<stdio.h>
 #include	<unistd.h>
@@ -27,11 +33,27 @@
 #include	<time.h>
 #include	<stdarg.h>
 #include	<pthread.h>
+#include	<sched.h>
 
 #include	<ev.h>
 
 #include	"nntpsink.h"
 #include	"charq.h"
+#include	"history.h"
+#include	"spool.h"
+#include	"histogram.h"
+
+#ifdef	USE_IO_URING
+# include	"uring.h"
+#endif
+
+#ifdef	HAVE_LIBNUMA
+# include	<numa.h>
+#endif
+
+#ifdef	HAVE_SYS_EPOLL_H
+# include	<sys/epoll.h>
+#endif
 
 char	*listen_host;
 char	*port;
@@ -40,45 +62,331 @@ int	 debug;
 int	 do_ihave = 1;
 int	 do_streaming = 1;
 
+size_t	 pool_max = 256;
+int	 pool_flags;
+
+int	 do_coalesce;
+int	 do_reuseport;
+int	 do_steer;
+int	 use_uring;
+int	 do_migrate;
+int	 do_blind;
+int	 do_edge;
+
+/*
+ * How much a client may read (bytes), and how many commands it may send, each
+ * time it's serviced, before other clients get a turn (-r).  0 is no limit.
+ */
+size_t	 read_budget = 256 * 1024;
+int	 line_budget;
+
+/*
+ * Stop reading from a client once this much output is waiting for it, and
+ * start again when it's down to write_low (-w).  Once buffers across all
+ * clients use more than mem_cap bytes, also stop reading from any client
+ * with more than write_low waiting (-W).  0 is no limit.
+ */
+size_t	 write_high = 1024 * 1024;
+size_t	 write_low = 256 * 1024;
+size_t	 mem_cap;
+size_t	 mem_inuse;
+
+/*
+ * The longest command line and article line we accept, and the most input we
+ * buffer for a client (-L, -i).  Line lengths include the line ending.  0 is
+ * no limit.
+ */
+size_t	 max_cmdline;
+size_t	 max_artline;
+size_t	 max_input;
+
+/* Message-IDs we've accepted, if -H or -f was given. */
+history_t *history;
+size_t	 history_size;
+unsigned history_expire = 24 * 60 * 60;
+char	*history_file;
+
+#define	HIST_SYNC_INTERVAL	10	/* Seconds between history file syncs */
+
+void	*history_run(void *);
+
+/* Where accepted articles are written, if -s was given. */
+spool_t	*spool;
+char	*spool_file;
+uint64_t spool_size;
+
+/*
+ * Response policy (-o): how many offers, out of 2^32, to defer, refuse and
+ * reject, as cumulative thresholds for a 32-bit roll.  The roll comes from the
+ * thread's PRNG or, with -k, from a hash of the message-ID and the key, so the
+ * same message-ID gets the same outcome every time.
+ */
+#define	PO_ACCEPT	0
+#define	PO_DEFER	1
+#define	PO_REFUSE	2
+#define	PO_REJECT	3
+
+int	 do_policy;
+uint64_t policy_defer, policy_refuse, policy_reject;
+int	 policy_keyed;
+uint64_t policy_key;
+
+int	 policy_parse(char const *);
+
+/*
+ * Delay replies by delay_ms milliseconds, plus up to delay_jitter more, chosen
+ * at random (-T).  Replies stay in order, so one may wait longer than that for
+ * an earlier one.
+ */
+int	 do_delay;
+unsigned delay_ms, delay_jitter;
+
+/*
+ * Delayed clients wait on a per-thread timer wheel of WHEEL_SLOTS slots of one
+ * millisecond each; a client is in the slot for the time its first reply is
+ * due, mod WHEEL_SLOTS, and is skipped until the wheel reaches that time.
+ */
+#define	WHEEL_SLOTS	1024
+
+/*
+ * Read shaping (-n): token buckets limiting how fast we read from each client,
+ * from all clients of each listening address, and from all clients.  A bucket
+ * is kept as the time (ns) at which it would be full again, GCRA-style, so the
+ * shared ones can be updated with a single CAS.  A client may read while every
+ * bucket it uses is within SHAPE_BURST of full; otherwise it stops reading
+ * until that's true again, and is checked by a per-thread timer every
+ * SHAPE_TICK seconds.
+ */
+typedef struct bucket {
+	uint64_t	bk_rate;	/* Bytes/sec; 0 is no limit */
+	uint64_t	bk_tat;		/* When it will be full, in ns */
+} bucket_t;
+
+#define	SHAPE_BURST	100000000ULL	/* ns */
+#define	SHAPE_TICK	.005
+
+typedef struct lsn_bucket {
+	struct sockaddr_storage	lb_addr;
+	bucket_t		lb_bucket;
+	uint64_t		lb_nread;	/* Bytes read, for stats */
+} lsn_bucket_t;
+
+int	 do_shape;
+uint64_t shape_conn, shape_listener;
+bucket_t shape_global;
+lsn_bucket_t *lsn_buckets;
+int	 nlsn_buckets;
+
+int	 shape_parse(char const *);
+void	 shape_add_listener(struct sockaddr *);
+lsn_bucket_t *shape_listener_bucket(int);
+uint64_t bucket_wait(bucket_t *, uint64_t);
+void	 bucket_charge(bucket_t *, uint64_t, size_t);
+
+/* How the acceptor chooses a thread for each new connection (-P). */
+#define	PL_RR		0	/* Round-robin */
+#define	PL_CONN		1	/* Fewest connections */
+#define	PL_RATE		2	/* Fewest bytes/sec read */
+#define	PL_HASH		3	/* Consistent hash of the peer address */
+int	 placement = PL_RR;
+
+#ifdef	HAVE_PTHREAD_SETAFFINITY_NP
+int	*worker_cpus;		/* -a */
+int	 nworker_cpus;
+int	 acceptor_cpu = -1;	/* -A */
+
+int	 parse_cpulist(char const *, int **);
+#endif
+
 #define		ignore_errno(e) ((e) == EAGAIN || (e) == EINPROGRESS || (e) == EWOULDBLOCK)
 
+#define	ACCEPTQ_SIZE	1024	/* Pending connections per thread; power of 2 */
+#define	ACCEPT_BATCH	256	/* Max. connections to accept per callback */
+
+#define	UR_ENTRIES	256	/* Submission queue size */
+#define	UR_NBUFS	64	/* Provided read buffers per thread */
+
+#define	RATE_SLACK	65536	/* Read rates closer than this are the same */
+
+#define	BLIND_BUFSZ	65536	/* -d: how much of a body to look at at once */
+
+#define	EDGE_BATCH	64	/* -e: events to fetch at once */
+
+TAILQ_HEAD(client_list, client);
+
+/*
+ * Counters for do_stats().  Only the thread that owns them writes them, with
+ * counter_add(), and they only ever grow; do_stats() reads them with
+ * load_relaxed() and reports the difference from last time.  They're on
+ * their own cache lines, so the thread's other data stays in its own cache.
+ */
+typedef struct thread_counters {
+	uint64_t		 tc_nsend,
+				 tc_naccepted,
+				 tc_nrefuse,
+				 tc_ndefer,
+				 tc_nreject,
+				 tc_nresp,
+				 tc_nwrite,
+				 tc_nbudget;
+	uint64_t		 tc_nshaped;	/* Times a client was throttled */
+	uint64_t		 tc_nread;	/* Bytes read */
+	uint64_t		 tc_nwritten;	/* Bytes written */
+	uint64_t		 tc_pool_nget,
+				 tc_pool_nhit;
+
+	/* Sizes of articles received, in bytes and lines. */
+	histogram_t		 tc_artbytes;
+	histogram_t		 tc_artlines;
+} cache_aligned thread_counters_t;
+
+#define	thread_count(th, c, n)	counter_add(&(th)->th_counters.c, (n))
+
 typedef struct thread {
 	pthread_t		 th_id;
 	struct ev_loop		*th_loop;
-	pthread_mutex_t		 th_mtx;
 	struct ev_prepare	 th_deadlist_ev;
 	struct client		*th_deadlist;
-
-	int			*th_accept;
-	int			 th_naccept;
-	int			 th_acceptsize;
+	struct ev_prepare	 th_flush_ev;
+	struct client		*th_flushlist;
+
+	/*
+	 * New connections from the acceptor.  This is a single-producer,
+	 * single-consumer ring: only the acceptor writes th_aq_tail, and only
+	 * this thread writes th_aq_head.
+	 *
+	 * Everything from here to th_aq_head is written by other threads, so
+	 * it's kept off the cache lines of the fields around it.
+	 */
+	int			 th_acceptq[ACCEPTQ_SIZE] cache_aligned;
+	unsigned		 th_aq_tail;
+	int			 th_aq_wake;	/* Acceptor: wakeup needed */
 	ev_async		 th_wakeup;
 
-	int			 th_nsend,
-				 th_naccepted,
-				 th_nrefuse,
-				 th_ndefer,
-				 th_nreject;
+	/*
+	 * Clients migrated to this thread by other threads.  Any thread may
+	 * push onto this list; this thread takes the whole list at once.
+	 */
+	struct client		*th_migrateq;
+
+	unsigned		 th_aq_head cache_aligned;
+
+	/*
+	 * Load, for placement and rebalancing.  Only this thread writes these,
+	 * but any thread may read them.
+	 */
+	struct client_list	 th_clients;
+	int			 th_nclients;
+	uint64_t		 th_rate;	/* Bytes/sec read, smoothed */
+	uint64_t		 th_lastread;	/* tc_nread at the last tick */
+
+	char			*th_scratch;	/* -d: BLIND_BUFSZ bytes */
+
+	/*
+	 * Clients which used up their budget with work left to do, and will be
+	 * serviced again on the next loop iteration.  While there are any, the
+	 * idle watcher stops the loop from blocking.
+	 */
+	struct client_list	 th_ready;
+	int			 th_nready;
+	ev_check		 th_ready_ev;
+	ev_idle			 th_idle_ev;
+
+#ifdef	HAVE_SYS_EPOLL_H
+	/* -e: clients are read through this edge-triggered epoll set. */
+	int			 th_epfd;
+	ev_io			 th_edge_ev;
+#endif
+
+	uint64_t		 th_rng;	/* PRNG state, never 0 */
+
+	/* -T: clients with delayed replies. */
+	struct client_list	*th_wheel;	/* WHEEL_SLOTS slots */
+	uint64_t		 th_wheel_now;	/* Last millisecond processed */
+	int			 th_nwheel;
+	ev_timer		 th_wheel_ev;
+
+	/* -n: clients waiting for their buckets to refill. */
+	struct client_list	 th_shaped;
+	ev_timer		 th_shape_ev;
+
 	ev_timer		 th_stats;
+	int			 th_nticks;
+
+	/* Sizes of articles received this tick, to publish to th_counters. */
+	histogram_t		 th_artbytes;
+	histogram_t		 th_artlines;
+
+	charq_pool_t		 th_pool;
+	size_t			 th_poolsize;	/* Read with load_relaxed() */
+
+	thread_counters_t	 th_counters;
+
+#ifdef	USE_IO_URING
+	uring_t			 th_ring;
+	uring_bufs_t		 th_bufs;
+	struct charq_ent	*th_bufents[UR_NBUFS];
+	ev_io			 th_ring_ev;
+#endif
 } thread_t;
 
 thread_t *threads;
 int	  nthreads = 1;
 int	  next_thread;
 
+/*
+ * Threads set themselves up, then wait here for main() to create the
+ * listeners; then main() waits again until it's done.
+ */
+pthread_barrier_t start_barrier;
+
 void	 thread_wakeup(struct ev_loop *, ev_async *, int);
 void	*thread_run(void *);
+void	 thread_init(thread_t *);
+void	 thread_pin(thread_t *);
 void	 thread_accept(thread_t *);
+void	 thread_adopt(thread_t *);
+int	 thread_handoff(int, struct sockaddr *);
+int	 thread_enqueue(thread_t *, int);
+thread_t *thread_place(struct sockaddr *);
+uint32_t thread_roll(thread_t *, char const *, size_t);
+int	 thread_policy(thread_t *, char const *, size_t);
+int	 thread_policy_takethis(thread_t *, int, char const *, size_t);
+uint32_t thread_random(thread_t *);
+void	 thread_wheel(struct ev_loop *, ev_timer *, int);
+void	 thread_shape(struct ev_loop *, ev_timer *, int);
+thread_t *thread_least_loaded(thread_t *);
+void	 thread_rebalance(thread_t *);
+void	 thread_ready(struct ev_loop *, ev_check *, int);
+void	 thread_idle(struct ev_loop *, ev_idle *, int);
+#ifdef	HAVE_SYS_EPOLL_H
+void	 thread_edge(struct ev_loop *, ev_io *, int);
+#endif
 void	 thread_deadlist(struct ev_loop *, ev_prepare *w, int revents);
+void	 thread_flush(struct ev_loop *, ev_prepare *w, int revents);
 void	 do_thread_stats(struct ev_loop *, ev_timer *w, int);
 
 typedef enum client_state {
 	CL_NORMAL,
 	CL_TAKETHIS,
-	CL_IHAVE
+	CL_IHAVE,
+	CL_SKIPLINE	/* Discarding the rest of an overlong line */
 } client_state_t;
 
 #define	CL_DEAD		0x1
+#define	CL_FLUSH	0x2	/* On the thread's flush list */
+#define	CL_ZOMBIE	0x4	/* Destroyed, waiting for io_uring ops to finish */
+#define	CL_READY	0x8	/* On the thread's ready list */
+#define	CL_PAUSED	0x10	/* Not reading until output drains */
+#define	CL_DELAYED	0x20	/* On the thread's timer wheel */
+#define	CL_SHAPED	0x40	/* Not reading until its buckets refill */
+#define	CL_CHECKED	0x80	/* Has sent CHECK */
+
+/* A reply held back by -T: cl_delaybuf holds the text. */
+typedef struct delayed {
+	uint64_t	dl_due;		/* Milliseconds, as ev_now() */
+	size_t		dl_len;
+} delayed_t;
 
 typedef struct client {
 	thread_t	*cl_thread;
@@ -90,23 +398,137 @@ typedef struct client {
 	client_state_t	 cl_state;
 	int		 cl_flags;
 	char		*cl_msgid;
+	size_t		 cl_msgidlen;
+	cq_body_t	 cl_body;
+	spool_art_t	*cl_art;	/* The article being spooled */
+	int		 cl_policy;	/* PO_* for the article being read */
 	struct client	*cl_next;
+	struct client	*cl_flush_next;
+	TAILQ_ENTRY(client) cl_list;
+	uint64_t	 cl_nread;	/* Bytes read since the last rebalance */
+	TAILQ_ENTRY(client) cl_ready_list;
+	int		 cl_nlines;	/* Commands handled this round */
+
+	/*
+	 * -T: delayed replies, oldest first, in a ring of cl_dsize entries
+	 * (a power of 2) indexed by free-running counters.
+	 */
+	charq_t		*cl_delaybuf;
+	delayed_t	*cl_delayed;
+	unsigned	 cl_dhead, cl_dtail, cl_dsize;
+	uint64_t	 cl_due;	/* When the newest one is due */
+	TAILQ_ENTRY(client) cl_wheel_list;
+	unsigned	 cl_wheel_slot;
+
+	/* -n: our own bucket, our listener's, and when to read again. */
+	bucket_t	 cl_bucket;
+	lsn_bucket_t	*cl_lbucket;
+	uint64_t	 cl_shaped_until;
+	TAILQ_ENTRY(client) cl_shaped_list;
+
+#ifdef	USE_IO_URING
+	int		 cl_nops;	/* io_uring operations in flight */
+	int		 cl_sending;	/* Whether a send is in flight */
+	struct msghdr	 cl_msg;
+	struct iovec	 cl_iov[CHARQ_IOVMAX];
+#endif
 } client_t;
 
+/* Output waiting for the client, including replies held back by -T. */
+#define	client_outlen(cl)	\
+	(cq_len((cl)->cl_wrbuf) + ((cl)->cl_delaybuf ? cq_len((cl)->cl_delaybuf) : 0))
+
+client_t *client_new(thread_t *, int);
+void	client_attach(thread_t *, client_t *);
+int	client_idle(client_t *);
+void	client_migrate(client_t *, thread_t *);
 void	client_read(struct ev_loop *, ev_io *, int);
+void	client_service(client_t *);
+int	client_process(client_t *);
+ssize_t	client_discard(client_t *);
+void	client_start_read(client_t *);
+void	client_stop_read(client_t *);
+void	client_ready(client_t *);
+int	client_backlogged(client_t *);
+void	client_pause(client_t *);
+void	client_resume(client_t *);
+void	client_article_start(client_t *, client_state_t, int, char const *, size_t);
+void	client_delay(client_t *, size_t);
+void	client_delay_append(client_t *, char const *, size_t);
+void	client_wheel_add(client_t *, uint64_t);
+void	client_wheel_remove(client_t *);
+void	client_release(client_t *, uint64_t);
+int	client_shape(client_t *);
+void	client_charge(client_t *, size_t);
+void	client_unshape(client_t *);
+void	client_article_done(client_t *);
+void	client_line_too_long(client_t *);
 void	client_write(struct ev_loop *, ev_io *, int);
 void	client_flush(client_t *);
+void	client_flush_later(client_t *);
 void	client_close(client_t *);
-void	client_send(client_t *, char const *);
+void	client_destroy(client_t *);
+void	client_sendn(client_t *, char const *, size_t);
+void	client_reply(client_t *, int, char const *, size_t);
 void	client_printf(client_t *, char const *, ...);
 void	client_vprintf(client_t *, char const *, va_list);
 
+/* Send a string constant; its length is known at compile time. */
+#define	client_send_lit(cl, s)	client_sendn((cl), (s), sizeof(s) - 1)
+
 typedef struct listener {
-	int	ln_fd;
-	ev_io	ln_readable;
+	int		 ln_fd;
+	ev_io		 ln_readable;
+	thread_t	*ln_thread;	/* With -R, the thread we accept for */
 } listener_t;
 
-void	listener_accept(struct ev_loop *, ev_io *, int);
+listener_t	*listener_new(struct addrinfo *, int reuseport);
+void		 listener_steer(listener_t *);
+void		 listener_accept(struct ev_loop *, ev_io *, int);
+int		 accept_nb(int, struct sockaddr *, socklen_t *);
+
+/*
+ * Commands are looked up in cmd_hash, which is built from the commands table
+ * at startup.  The key is the first (up to) eight bytes of the command,
+ * upper-cased and packed into an integer; longer commands are compared in full
+ * once the key matches.  To add a command, add it to the commands table.
+ */
+typedef void (*cmd_handler_t) (client_t *, char *, size_t);
+
+typedef struct command {
+	char const	*cm_name;
+	cmd_handler_t	 cm_handler;
+	int		 cm_flags;
+	size_t		 cm_len;
+	uint64_t	 cm_key;
+} command_t;
+
+#define	CM_STREAMING	0x1	/* Only available with streaming */
+#define	CM_IHAVE	0x2	/* Only available with IHAVE */
+#define	CM_NEEDARG	0x4	/* Requires a message-id */
+
+void	cmd_init(void);
+void	cmd_dispatch(client_t *, char *, size_t);
+
+void	cmd_capabilities(client_t *, char *, size_t);
+void	cmd_quit(client_t *, char *, size_t);
+void	cmd_mode(client_t *, char *, size_t);
+void	cmd_check(client_t *, char *, size_t);
+void	cmd_takethis(client_t *, char *, size_t);
+void	cmd_ihave(client_t *, char *, size_t);
+
+command_t commands[] = {
+	{ "CHECK",		cmd_check,		CM_STREAMING | CM_NEEDARG, 0, 0 },
+	{ "TAKETHIS",		cmd_takethis,		CM_STREAMING | CM_NEEDARG, 0, 0 },
+	{ "IHAVE",		cmd_ihave,		CM_IHAVE | CM_NEEDARG, 0, 0 },
+	{ "MODE",		cmd_mode,		0, 0, 0 },
+	{ "CAPABILITIES",	cmd_capabilities,	0, 0, 0 },
+	{ "QUIT",		cmd_quit,		0, 0, 0 },
+};
+
+#define	CMD_HASHBITS	5
+#define	CMD_HASHSZ	(1 << CMD_HASHBITS)
+command_t	*cmd_hash[CMD_HASHSZ];
 
 struct ev_loop	*main_loop;
 ev_timer	 stats_timer;
@@ -114,16 +536,53 @@ time_t		 start_time;
 
 void	 usage(char const *);
 
-int	nsend, naccept, ndefer, nreject, nrefuse;
 void	do_stats(struct ev_loop *, ev_timer *w, int);
-pthread_mutex_t	stats_mtx;
+void	stats_collect(thread_counters_t *);
+void	stats_sub(thread_counters_t *, thread_counters_t const *);
+
+#ifdef	USE_IO_URING
+/*
+ * The io_uring engine (-u).  Each thread has a ring whose eventfd is watched
+ * by the thread's ev_loop; everything else (timers, wakeups, the deadlist)
+ * still goes through libev.  Clients read with a multishot recv into charq
+ * blocks taken from a provided buffer ring; replies are sent with sendmsg,
+ * and all new operations are submitted together once per loop iteration.
+ * -R listeners use multishot accept.
+ *
+ * The low bits of each operation's user_data say what kind of operation it
+ * is; the rest is a pointer to the client or listener.
+ */
+#define	UR_RECV		1
+#define	UR_SEND		2
+#define	UR_ACCEPT	3
+#define	UR_OPMASK	7
+
+#define	ur_data(p, op)	((uint64_t) (uintptr_t) (p) | (op))
+#define	ur_ptr(d)	((void *) (uintptr_t) ((d) & ~(uint64_t) UR_OPMASK))
+
+int			 thread_uring_init(thread_t *);
+void			 thread_uring_reap(struct ev_loop *, ev_io *, int);
+struct io_uring_sqe	*thread_get_sqe(thread_t *);
+void			 client_uring_recv(client_t *);
+void			 client_uring_recvd(client_t *, int, unsigned);
+void			 client_uring_send(client_t *);
+void			 client_uring_sent(client_t *, int);
+void			 client_uring_done(client_t *);
+void			 listener_uring_accept(listener_t *);
+void			 listener_uring_accepted(listener_t *, int, unsigned);
+#endif
 
 void
 usage(p)
 	char const	*p;
 {
 	fprintf(stderr,
-"usage: %s [-VDhIS] [-t <threads>] [-l <host>] [-p <port>]\n"
+"usage: %s [-VDhISGcRqumde] [-t <threads>] [-l <host>] [-p <port>] [-b <blocks>]\n"
+"          [-P <policy>] [-a <cpulist>] [-A <cpu>] [-r <bytes>[:<lines>]]\n"
+"          [-w <high>[:<low>]] [-W <bytes>] [-L <cmd>[:<article>]] [-i <bytes>]\n"
+"          [-H <megabytes>] [-x <seconds>] [-f <file>] [-s <file>]\n"
+"          [-z <megabytes>] [-o <policy>] [-k <key>] [-T <ms>[,<jitter>]]\n"
+"          [-n <limits>]\n"
 "\n"
 "    -V                   print version and exit\n"
 "    -h                   print this text\n"
@@ -133,6 +592,52 @@ usage(p)
 "    -l <host>            address to listen on (default: localhost)\n"
 "    -p <port>            port to listen on (default: 119)\n"
 "    -t <threads>         number of processing threads (default: 1)\n"
+"    -b <blocks>          free buffer blocks to cache per thread (default: 256)\n"
+"    -G                   allocate buffer blocks from huge pages\n"
+"    -c                   coalesce replies and write them once per loop\n"
+"    -R                   give each thread its own listener (SO_REUSEPORT)\n"
+"    -q                   with -R, steer connections by receiving CPU\n"
+"    -u                   use the io_uring I/O engine\n"
+"    -P <policy>          how to assign connections to threads:\n"
+"                           rr    round-robin (default)\n"
+"                           conn  thread with the fewest connections\n"
+"                           rate  thread reading the fewest bytes/sec\n"
+"                           hash  consistent hash of the peer address\n"
+"    -m                   move idle connections from busy threads to less\n"
+"                         busy ones\n"
+"    -a <cpulist>         pin threads to these CPUs, e.g. 0-3,8-11\n"
+"    -A <cpu>             pin the acceptor to this CPU, and keep threads off it\n"
+"    -d                   discard article bodies without buffering them\n"
+"    -r <bytes>[:<lines>] read at most this much, and handle at most this\n"
+"                         many commands, from a client before servicing\n"
+"                         others (default: 262144:0; 0 is no limit)\n"
+"    -e                   read clients edge-triggered\n"
+"    -w <high>[:<low>]    stop reading from a client with <high> bytes of\n"
+"                         output waiting, until it's down to <low>\n"
+"                         (default: 1048576:262144; 0 is no limit)\n"
+"    -W <bytes>           limit buffer memory across all clients\n"
+"    -L <cmd>[:<article>] longest command and article lines to accept\n"
+"    -i <bytes>           most input to buffer for a client\n"
+"    -H <megabytes>       remember accepted message-IDs, and refuse or\n"
+"                         reject them if they're offered again\n"
+"    -x <seconds>         forget message-IDs after this long (default: 86400;\n"
+"                         0 is never)\n"
+"    -f <file>            keep the history in this file, created with the\n"
+"                         size given by -H if it doesn't exist\n"
+"    -s <file>            write accepted articles to this cyclic spool file\n"
+"    -z <megabytes>       size to create the spool with if it doesn't exist\n"
+"    -o <policy>          answer a share of offers other than with acceptance;\n"
+"                         <policy> is a list of defer=<pct>, refuse=<pct> and\n"
+"                         reject=<pct>, e.g. \"defer=5,reject=1.5\".  CHECK is\n"
+"                         deferred with 431 or refused with 438; IHAVE with 436\n"
+"                         or 435; articles are rejected with 439 or 437\n"
+"    -k <key>             with -o, choose outcomes from a hash of the message-ID\n"
+"                         and <key> instead of randomly, so they're repeatable\n"
+"    -T <ms>[,<jitter>]   delay replies to CHECK, TAKETHIS and IHAVE by <ms>\n"
+"                         milliseconds, plus a random 0 to <jitter> more\n"
+"    -n <limits>          limit how fast we read; <limits> is a list of\n"
+"                         conn=<rate>, listener=<rate> and global=<rate>, in\n"
+"                         bytes/sec with an optional K, M or G suffix\n"
 , p);
 }
 
@@ -140,11 +645,11 @@ int
 main(ac, av)
 	char	**av;
 {
-int	 c, i;
+int	 c, i, wflag = 0;
 char	*progname = av[0];
 struct addrinfo	*res, *r, hints;
 
-	while ((c = getopt(ac, av, "VDSIhl:p:t:")) != -1) {
+	while ((c = getopt(ac, av, "VDSIGcRqumdehl:p:t:b:P:a:A:r:w:W:L:i:H:x:f:s:z:o:k:T:n:")) != -1) {
 		switch (c) {
 		case 'V':
 			printf("nntpsink %s\n", PACKAGE_VERSION);
@@ -180,6 +685,272 @@ struct addrinfo	*res, *r, hints;
 			}
 			break;
 
+		case 'b': {
+		char	*end;
+			errno = 0;
+			pool_max = strtoul(optarg, &end, 10);
+			if (*end != '\0' || end == optarg || errno == ERANGE) {
+				fprintf(stderr, "%s: invalid pool size \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			break;
+		}
+
+		case 'G':
+			pool_flags |= CQP_HUGEPAGE;
+			break;
+
+		case 'c':
+			do_coalesce = 1;
+			break;
+
+		case 'R':
+#ifdef	SO_REUSEPORT
+			do_reuseport = 1;
+			break;
+#else
+			fprintf(stderr, "%s: -R is not supported on this platform\n",
+				av[0]);
+			return 1;
+#endif
+
+		case 'q':
+			do_steer = 1;
+			break;
+
+		case 'u':
+#ifdef	USE_IO_URING
+			use_uring = 1;
+			break;
+#else
+			fprintf(stderr, "%s: not built with io_uring support\n",
+				av[0]);
+			return 1;
+#endif
+
+		case 'P':
+			if (strcmp(optarg, "rr") == 0)
+				placement = PL_RR;
+			else if (strcmp(optarg, "conn") == 0)
+				placement = PL_CONN;
+			else if (strcmp(optarg, "rate") == 0)
+				placement = PL_RATE;
+			else if (strcmp(optarg, "hash") == 0)
+				placement = PL_HASH;
+			else {
+				fprintf(stderr, "%s: unknown placement policy \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			break;
+
+		case 'm':
+			do_migrate = 1;
+			break;
+
+		case 'd':
+			do_blind = 1;
+			break;
+
+		case 'r': {
+		char	*end;
+			read_budget = strtoul(optarg, &end, 10);
+			if (*end == ':')
+				line_budget = strtol(end + 1, &end, 10);
+			if (*end != '\0' || line_budget < 0) {
+				fprintf(stderr, "%s: invalid budget \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			break;
+		}
+
+		case 'w': {
+		char	*end;
+			write_high = strtoul(optarg, &end, 10);
+			write_low = write_high / 4;
+			if (*end == ':')
+				write_low = strtoul(end + 1, &end, 10);
+			if (*end != '\0' || write_low > write_high) {
+				fprintf(stderr, "%s: invalid watermarks \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			wflag = 1;
+			break;
+		}
+
+		case 'W': {
+		char	*end;
+			errno = 0;
+			mem_cap = strtoul(optarg, &end, 10);
+			if (*end != '\0' || end == optarg || errno == ERANGE) {
+				fprintf(stderr, "%s: invalid memory limit \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			break;
+		}
+
+		case 'L': {
+		char	*end;
+			max_cmdline = strtoul(optarg, &end, 10);
+			if (*end == ':')
+				max_artline = strtoul(end + 1, &end, 10);
+			if (*end != '\0') {
+				fprintf(stderr, "%s: invalid line lengths \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			break;
+		}
+
+		case 'i': {
+		char	*end;
+			errno = 0;
+			max_input = strtoul(optarg, &end, 10);
+			if (*end != '\0' || end == optarg || errno == ERANGE) {
+				fprintf(stderr, "%s: invalid input limit \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			break;
+		}
+
+		case 'H': {
+		char	*end;
+			errno = 0;
+			history_size = strtoul(optarg, &end, 10);
+			if (*end != '\0' || end == optarg || errno == ERANGE
+			    || history_size == 0
+			    || history_size > SIZE_MAX / (1024 * 1024)) {
+				fprintf(stderr, "%s: invalid history size \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			history_size *= 1024 * 1024;
+			break;
+		}
+
+		case 'f':
+			free(history_file);
+			history_file = strdup(optarg);
+			break;
+
+		case 'o':
+			if (policy_parse(optarg) == -1) {
+				fprintf(stderr, "%s: invalid policy \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			do_policy = 1;
+			break;
+
+		case 'T': {
+		char	*end;
+			delay_ms = strtoul(optarg, &end, 10);
+			if (*end == ',')
+				delay_jitter = strtoul(end + 1, &end, 10);
+			if (*end != '\0') {
+				fprintf(stderr, "%s: invalid delay \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			do_delay = delay_ms || delay_jitter;
+			break;
+		}
+
+		case 'n':
+			if (shape_parse(optarg) == -1) {
+				fprintf(stderr, "%s: invalid rate limits \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			do_shape = 1;
+			break;
+
+		case 'k': {
+		char	*end;
+			errno = 0;
+			policy_key = strtoull(optarg, &end, 10);
+			if (*end != '\0' || end == optarg || errno == ERANGE) {
+				fprintf(stderr, "%s: invalid policy key \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			policy_keyed = 1;
+			break;
+		}
+
+		case 's':
+			free(spool_file);
+			spool_file = strdup(optarg);
+			break;
+
+		case 'z': {
+		char	*end;
+			errno = 0;
+			spool_size = strtoull(optarg, &end, 10);
+			if (*end != '\0' || end == optarg || errno == ERANGE
+			    || spool_size > UINT64_MAX / (1024 * 1024)) {
+				fprintf(stderr, "%s: invalid spool size \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			spool_size *= 1024 * 1024;
+			break;
+		}
+
+		case 'x':
+			if ((history_expire = strtoul(optarg, NULL, 10))
+			    > HIST_MAXEXPIRE) {
+				fprintf(stderr, "%s: expiry time may not be more than %d seconds\n",
+					av[0], HIST_MAXEXPIRE);
+				return 1;
+			}
+			break;
+
+		case 'e':
+#ifdef	HAVE_SYS_EPOLL_H
+			do_edge = 1;
+			break;
+#else
+			fprintf(stderr, "%s: -e is not supported on this platform\n",
+				av[0]);
+			return 1;
+#endif
+
+		case 'a':
+#ifdef	HAVE_PTHREAD_SETAFFINITY_NP
+			free(worker_cpus);
+			if ((nworker_cpus = parse_cpulist(optarg, &worker_cpus)) <= 0) {
+				fprintf(stderr, "%s: invalid CPU list \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			break;
+#else
+			fprintf(stderr, "%s: -a is not supported on this platform\n",
+				av[0]);
+			return 1;
+#endif
+
+		case 'A':
+#ifdef	HAVE_PTHREAD_SETAFFINITY_NP
+			if ((acceptor_cpu = atoi(optarg)) < 0
+			    || acceptor_cpu >= CPU_SETSIZE) {
+				fprintf(stderr, "%s: invalid CPU \"%s\"\n",
+					av[0], optarg);
+				return 1;
+			}
+			break;
+#else
+			fprintf(stderr, "%s: -A is not supported on this platform\n",
+				av[0]);
+			return 1;
+#endif
+
 		case 'h':
 			usage(av[0]);
 			return 0;
@@ -194,11 +965,87 @@ struct addrinfo	*res, *r, hints;
 
 	signal(SIGPIPE, SIG_IGN);
 
+	if (do_steer && !do_reuseport) {
+		fprintf(stderr, "%s: -q requires -R\n", progname);
+		return 1;
+	}
+
+	if (placement != PL_RR && do_reuseport) {
+		fprintf(stderr, "%s: -P cannot be used with -R\n", progname);
+		return 1;
+	}
+
+	/*
+	 * Clients on a hashed thread must stay there, and an io_uring client
+	 * always has a recv in flight on its thread's ring, so can't be moved.
+	 */
+	if (do_migrate && placement == PL_HASH) {
+		fprintf(stderr, "%s: -m cannot be used with -P hash\n", progname);
+		return 1;
+	}
+
+	if (do_migrate && use_uring) {
+		fprintf(stderr, "%s: -m cannot be used with -u\n", progname);
+		return 1;
+	}
+
+	/*
+	 * io_uring clients have bodies read straight into buffer blocks that
+	 * are then discarded without copying, so -d has nothing to add.
+	 */
+	if (do_blind && use_uring) {
+		fprintf(stderr, "%s: -d cannot be used with -u\n", progname);
+		return 1;
+	}
+
+	if (do_shape && use_uring) {
+		fprintf(stderr, "%s: -n cannot be used with -u\n", progname);
+		return 1;
+	}
+
+	if (do_edge && use_uring) {
+		fprintf(stderr, "%s: -e cannot be used with -u\n", progname);
+		return 1;
+	}
+
+	/*
+	 * The io_uring engine reads whatever the kernel gives it; only a line
+	 * budget would make sense, and it has no ready list to resume from.
+	 */
+	if (line_budget && use_uring) {
+		fprintf(stderr, "%s: a line budget cannot be used with -u\n",
+			progname);
+		return 1;
+	}
+
+	/*
+	 * Likewise, a multishot recv can't be paused, so the io_uring engine
+	 * has no write backpressure.
+	 */
+	if (use_uring) {
+		if (mem_cap) {
+			fprintf(stderr, "%s: -W cannot be used with -u\n", progname);
+			return 1;
+		}
+		if (wflag) {
+			fprintf(stderr, "%s: -w cannot be used with -u\n", progname);
+			return 1;
+		}
+		write_high = 0;
+	}
+
 	if (!do_ihave && !do_streaming) {
 		fprintf(stderr, "%s: -I and -S may not both be specified\n", progname);
 		return 1;
 	}
 
+	/*
+	 * Outside an article, input is only buffered while we wait for the
+	 * end of a line, so the input limit is also a line length limit.
+	 */
+	if (max_input && (max_cmdline == 0 || max_input < max_cmdline))
+		max_cmdline = max_input;
+
 	if (!listen_host)
 		listen_host = strdup("localhost");
 
@@ -210,73 +1057,142 @@ struct addrinfo	*res, *r, hints;
 		return 1;
 	}
 
-	main_loop = ev_loop_new(ev_supported_backends());
+	cmd_init();
 
-	bzero(&hints, sizeof(hints));
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE;
-	i = getaddrinfo(listen_host, port, &hints, &res);
+	if (history_file) {
+		if ((history = hist_open(history_file, history_size,
+					 history_expire)) == NULL) {
+			fprintf(stderr, "%s: %s: %s\n", progname, history_file,
+				errno == ENOENT ? "does not exist, and -H not given"
+				: errno == EINVAL ? "not a valid history file"
+				: strerror(errno));
+			return 1;
+		}
 
-	if (i) {
-		fprintf(stderr, "%s: %s:%s: %s\n",
-			progname, listen_host, port, gai_strerror(i));
+		if (history_size && (history->hi_size > history_size
+				     || history->hi_size * 2 <= history_size))
+			fprintf(stderr, "%s: %s: using existing size of %lu MB\n",
+				progname, history_file,
+				(unsigned long) (history->hi_size / 1024 / 1024));
+	} else if (history_size
+	    && (history = hist_new(history_size, history_expire)) == NULL) {
+		fprintf(stderr, "%s: cannot allocate history: %s\n",
+			progname, strerror(errno));
 		return 1;
 	}
 
-	for (r = res; r; r = r->ai_next) {
-	listener_t	*lsn = xcalloc(1, sizeof(*lsn));
-	int		 fl, one = 1;
-	char		 sname[NI_MAXHOST];
+	if (history && (history_file || history_expire)) {
+	pthread_t	tid;
+	int		err;
 
-		if ((lsn->ln_fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol)) == -1) {
-			fprintf(stderr, "%s:%s: socket: %s\n",
-				listen_host, port, strerror(errno));
+		if ((err = pthread_create(&tid, NULL, history_run, NULL)) != 0) {
+			fprintf(stderr, "%s: cannot create history thread: %s\n",
+				progname, strerror(err));
 			return 1;
 		}
+	}
 
-		if ((fl = fcntl(lsn->ln_fd, F_GETFL, 0)) == -1) {
-			fprintf(stderr, "%s:%s: fgetfl: %s\n",
-				listen_host, port, strerror(errno));
+	if (spool_file) {
+		if ((spool = spool_open(spool_file, spool_size)) == NULL) {
+			fprintf(stderr, "%s: %s: %s\n", progname, spool_file,
+				errno == ENOENT ? "does not exist, and -z not given"
+				: errno == EINVAL ? "not a valid spool file"
+				: strerror(errno));
 			return 1;
 		}
 
-		if (fcntl(lsn->ln_fd, F_SETFL, fl | O_NONBLOCK) == -1) {
-			fprintf(stderr, "%s:%s: fsetfl: %s\n",
-				listen_host, port, strerror(errno));
-			return 1;
+		/* Articles waiting to be written count against -W too. */
+		if (mem_cap) {
+			spool->sp_inuse = &mem_inuse;
+			spool->sp_memcap = mem_cap;
 		}
 
-		if (setsockopt(lsn->ln_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
-			fprintf(stderr, "%s:%s: setsockopt(TCP_NODELAY): %s\n",
-				listen_host, port, strerror(errno));
+		if (spool_start(spool) == -1) {
+			fprintf(stderr, "%s: cannot start spool writer: %s\n",
+				progname, strerror(errno));
 			return 1;
 		}
+	}
 
-		if (setsockopt(lsn->ln_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
-			fprintf(stderr, "%s:%s: setsockopt(SO_REUSEADDR): %s\n",
-				listen_host, port, strerror(errno));
-			return 1;
-		}
+	main_loop = ev_loop_new(ev_supported_backends());
 
-		if (bind(lsn->ln_fd, r->ai_addr, r->ai_addrlen) == -1) {
-			getnameinfo(r->ai_addr, r->ai_addrlen, sname, sizeof(sname),
-					NULL, 0, NI_NUMERICHOST);
-			fprintf(stderr, "%s[%s]:%s: bind: %s\n",
-				listen_host, sname, port, strerror(errno));
-			return 1;
-		}
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	i = getaddrinfo(listen_host, port, &hints, &res);
+
+	if (i) {
+		fprintf(stderr, "%s: %s:%s: %s\n",
+			progname, listen_host, port, gai_strerror(i));
+		return 1;
+	}
 
-		if (listen(lsn->ln_fd, 128) == -1) {
-			fprintf(stderr, "%s:%s: listen: %s\n",
-				listen_host, port, strerror(errno));
+	/*
+	 * Each thread sets up its own loop and buffers, so that once it's
+	 * pinned, its memory is local to the CPU it runs on.
+	 */
+	if (posix_memalign((void **) &threads, CACHE_LINE,
+			   nthreads * sizeof(thread_t)) != 0) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	bzero(threads, nthreads * sizeof(thread_t));
+	pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i].th_id, NULL, thread_run, &threads[i]);
+
+#ifdef	HAVE_PTHREAD_SETAFFINITY_NP
+	/*
+	 * Pin the acceptor only after the threads have been created, since
+	 * they inherit our affinity.
+	 */
+	if (acceptor_cpu >= 0) {
+	cpu_set_t	set;
+
+		CPU_ZERO(&set);
+		CPU_SET(acceptor_cpu, &set);
+		if ((i = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+			fprintf(stderr, "%s: cannot pin acceptor to CPU %d: %s\n",
+				progname, acceptor_cpu, strerror(i));
 			return 1;
 		}
+	}
+#endif
 
-		ev_io_init(&lsn->ln_readable, listener_accept, lsn->ln_fd, EV_READ);
-		lsn->ln_readable.data = lsn;
+	pthread_barrier_wait(&start_barrier);
 
-		ev_io_start(main_loop, &lsn->ln_readable);
+	for (r = res; r; r = r->ai_next) {
+	listener_t	*lsn;
+
+		if (shape_listener)
+			shape_add_listener(r->ai_addr);
+
+		if (!do_reuseport) {
+			if ((lsn = listener_new(r, 0)) == NULL)
+				return 1;
+			ev_io_start(main_loop, &lsn->ln_readable);
+			continue;
+		}
+
+		/*
+		 * Give each thread its own listener, and let the kernel
+		 * distribute connections between them.
+		 */
+		for (i = 0; i < nthreads; i++) {
+			if ((lsn = listener_new(r, 1)) == NULL)
+				return 1;
+			lsn->ln_thread = &threads[i];
+#ifdef	USE_IO_URING
+			if (use_uring)
+				listener_uring_accept(lsn);
+			else
+#endif
+				ev_io_start(threads[i].th_loop, &lsn->ln_readable);
+
+			if (i == 0 && do_steer)
+				listener_steer(lsn);
+		}
 	}
 		
 	freeaddrinfo(res);
@@ -284,24 +1200,7 @@ struct addrinfo	*res, *r, hints;
 	ev_timer_init(&stats_timer, do_stats, 1., 1.);
 	ev_timer_start(main_loop, &stats_timer);
 
-	threads = xcalloc(nthreads, sizeof(thread_t));
-	for (i = 0; i < nthreads; i++) {
-	thread_t	*th = &threads[i];
-
-		th->th_loop = ev_loop_new(ev_supported_backends());
-
-		ev_async_init(&th->th_wakeup, thread_wakeup);
-		th->th_wakeup.data = th;
-
-		ev_prepare_init(&th->th_deadlist_ev, thread_deadlist);
-		th->th_deadlist_ev.data = th;
- 
-		ev_timer_init(&th->th_stats, do_thread_stats, .1, .1); 
-		th->th_stats.data = th;
-
-		pthread_mutex_init(&th->th_mtx, NULL);
-		pthread_create(&th->th_id, NULL, thread_run, th);
-	}
+	pthread_barrier_wait(&start_barrier);
 
 	time(&start_time);
 	ev_run(main_loop, 0);
@@ -314,309 +1213,2452 @@ thread_run(p)
 	void	*p;
 {
 thread_t	*th = p;
+
+	thread_pin(th);
+	thread_init(th);
+
+	pthread_barrier_wait(&start_barrier);
+	pthread_barrier_wait(&start_barrier);
+
 	ev_async_start(th->th_loop, &th->th_wakeup);
 	ev_prepare_start(th->th_loop, &th->th_deadlist_ev);
+	ev_prepare_start(th->th_loop, &th->th_flush_ev);
 	ev_timer_start(th->th_loop, &th->th_stats);
+#ifdef	USE_IO_URING
+	if (use_uring)
+		ev_io_start(th->th_loop, &th->th_ring_ev);
+#endif
+#ifdef	HAVE_SYS_EPOLL_H
+	if (do_edge)
+		ev_io_start(th->th_loop, &th->th_edge_ev);
+#endif
 	ev_run(th->th_loop, 0);
 	return NULL;
 }
 
 void
-thread_wakeup(loop, w, revents)
-	struct ev_loop	*loop;
-	ev_async	*w;
-{
-thread_t	*th = w->data;
-	thread_accept(th);
-}
-
-void
-thread_accept(th)
+thread_init(th)
 	thread_t	*th;
 {
-int	i;
+	th->th_loop = ev_loop_new(ev_supported_backends());
 
-	pthread_mutex_lock(&th->th_mtx);
-	
-	for (i = 0; i < th->th_naccept; i++) {
-	client_t	*client = xcalloc(1, sizeof(*client));
-	int		 one = 1;
-	int		 fd = th->th_accept[i];
+	ev_async_init(&th->th_wakeup, thread_wakeup);
+	th->th_wakeup.data = th;
+	TAILQ_INIT(&th->th_clients);
 
-		client->cl_fd = fd;
-		if (setsockopt(client->cl_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
-			close(fd);
-			free(client);
-			continue;
-		}
-
-		client->cl_thread = th;
-		client->cl_rdbuf = cq_new();
-		client->cl_wrbuf = cq_new();
+	TAILQ_INIT(&th->th_shaped);
+	ev_timer_init(&th->th_shape_ev, thread_shape, SHAPE_TICK, SHAPE_TICK);
+	th->th_shape_ev.data = th;
 
-		ev_io_init(&client->cl_readable, client_read, client->cl_fd, EV_READ);
-		client->cl_readable.data = client;
+	th->th_rng = ((uint64_t) time(NULL) << 16) + (th - threads) + 1;
 
-		ev_io_init(&client->cl_writable, client_write, client->cl_fd, EV_WRITE);
-		client->cl_writable.data = client;
+	if (do_delay) {
+	int	i;
 
-		ev_io_start(th->th_loop, &client->cl_readable);
-		client_printf(client, "200 nntpsink ready.\r\n");
-		client_flush(client);
+		th->th_wheel = xcalloc(WHEEL_SLOTS, sizeof(*th->th_wheel));
+		for (i = 0; i < WHEEL_SLOTS; i++)
+			TAILQ_INIT(&th->th_wheel[i]);
+		ev_timer_init(&th->th_wheel_ev, thread_wheel, .001, .001);
+		th->th_wheel_ev.data = th;
 	}
 
-	th->th_naccept = 0;
-	pthread_mutex_unlock(&th->th_mtx);
+	ev_prepare_init(&th->th_deadlist_ev, thread_deadlist);
+	th->th_deadlist_ev.data = th;
+
+	/*
+	 * Flush before the deadlist runs, so we never touch a client that has
+	 * already been destroyed.
+	 */
+	ev_prepare_init(&th->th_flush_ev, thread_flush);
+	th->th_flush_ev.data = th;
+	ev_set_priority(&th->th_flush_ev, EV_MAXPRI);
+
+	ev_timer_init(&th->th_stats, do_thread_stats, .1, .1);
+	th->th_stats.data = th;
+
+	TAILQ_INIT(&th->th_ready);
+	ev_check_init(&th->th_ready_ev, thread_ready);
+	th->th_ready_ev.data = th;
+	ev_idle_init(&th->th_idle_ev, thread_idle);
+
+#ifdef	HAVE_SYS_EPOLL_H
+	if (do_edge) {
+		if ((th->th_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+			exit(1);
+		}
+		ev_io_init(&th->th_edge_ev, thread_edge, th->th_epfd, EV_READ);
+		th->th_edge_ev.data = th;
+	}
+#endif
+
+	cq_pool_init(&th->th_pool, pool_max, pool_flags);
+	if (mem_cap)
+		th->th_pool.cqp_inuse = &mem_inuse;
+	if (do_blind)
+		th->th_scratch = xmalloc(BLIND_BUFSZ);
+
+#ifdef	USE_IO_URING
+	if (use_uring && thread_uring_init(th) == -1) {
+		fprintf(stderr, "io_uring: %s\n", strerror(errno));
+		exit(1);
+	}
+#endif
 }
 
+/*
+ * Pin the calling thread according to -a and -A.  With -a, each thread gets
+ * one CPU from the list, wrapping around if there are more threads than CPUs;
+ * with only -A, threads may use any CPU but the acceptor's.  Memory the thread
+ * allocates after this will come from its own node.
+ */
 void
-listener_accept(loop, w, revents)
-	struct ev_loop	*loop;
-	ev_io		*w;
+thread_pin(th)
+	thread_t	*th;
 {
-int			 fd;
-listener_t		*lsn = w->data;
-struct sockaddr_storage	 addr;
-socklen_t		 addrlen;
-
-	while ((fd = accept(lsn->ln_fd, (struct sockaddr *) &addr, &addrlen)) >= 0) {
-	thread_t	*th = &threads[next_thread];
-
-		pthread_mutex_lock(&th->th_mtx);
-		if (++th->th_naccept > th->th_acceptsize) {
-			th->th_accept = realloc(th->th_accept,
-						sizeof(int) * (th->th_acceptsize * 2));
-			th->th_acceptsize *= 2;
-		}
-
-		th->th_accept[th->th_naccept - 1] = fd;
-		ev_async_send(th->th_loop, &th->th_wakeup);
-		pthread_mutex_unlock(&th->th_mtx);
+#ifdef	HAVE_PTHREAD_SETAFFINITY_NP
+cpu_set_t	set;
+int		err;
+
+	CPU_ZERO(&set);
+	if (nworker_cpus)
+		CPU_SET(worker_cpus[(th - threads) % nworker_cpus], &set);
+	else if (acceptor_cpu >= 0) {
+		if (sched_getaffinity(0, sizeof(set), &set) == -1)
+			return;
+		CPU_CLR(acceptor_cpu, &set);
+		if (CPU_COUNT(&set) == 0)
+			return;
+	} else
+		return;
 
-		if (next_thread == (nthreads - 1))
-			next_thread = 0;
-		else
-			++next_thread;
+	if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+		fprintf(stderr, "thread %d: cannot set CPU affinity: %s\n",
+			(int) (th - threads), strerror(err));
+		return;
 	}
 
-	if (!ignore_errno(errno))
-		fprintf(stderr, "accept: %s", strerror(errno));
+# ifdef	HAVE_LIBNUMA
+	/*
+	 * First-touch placement already does this, unless we were started
+	 * under a different memory policy (e.g. numactl --interleave).
+	 */
+	if (numa_available() != -1)
+		numa_set_localalloc();
+# endif
+#endif
 }
 
+#ifdef	HAVE_PTHREAD_SETAFFINITY_NP
+/*
+ * Parse a list of CPUs like "0-3,8,10-11" into an array.  Returns the number
+ * of CPUs, or -1 if the list is invalid.
+ */
+int
+parse_cpulist(list, cpus)
+	char const	*list;
+	int		**cpus;
+{
+int		 n = 0, lo, hi;
+char		*end;
+
+	*cpus = xcalloc(CPU_SETSIZE, sizeof(int));
+
+	for (;;) {
+		lo = hi = strtol(list, &end, 10);
+		if (end == list)
+			goto err;
+
+		if (*end == '-') {
+			list = end + 1;
+			hi = strtol(list, &end, 10);
+			if (end == list)
+				goto err;
+		}
+
+		if (lo < 0 || hi < lo || hi >= CPU_SETSIZE
+		    || n + (hi - lo + 1) > CPU_SETSIZE)
+			goto err;
+
+		while (lo <= hi)
+			(*cpus)[n++] = lo++;
+
+		if (*end == '\0')
+			return n;
+		if (*end != ',')
+			goto err;
+		list = end + 1;
+	}
+
+err:
+	free(*cpus);
+	*cpus = NULL;
+	return -1;
+}
+#endif
+
+/*
+ * Parse rate limits like "conn=64K,global=10M".
+ */
+int
+shape_parse(spec)
+	char const	*spec;
+{
+uint64_t	*rate;
+char		*end;
+
+	for (;;) {
+		if (strncmp(spec, "conn=", 5) == 0) {
+			rate = &shape_conn;
+			spec += 5;
+		} else if (strncmp(spec, "listener=", 9) == 0) {
+			rate = &shape_listener;
+			spec += 9;
+		} else if (strncmp(spec, "global=", 7) == 0) {
+			rate = &shape_global.bk_rate;
+			spec += 7;
+		} else
+			return -1;
+
+		*rate = strtoull(spec, &end, 10);
+		if (end == spec)
+			return -1;
+
+		switch (*end) {
+		case 'G': case 'g':	*rate *= 1024;	/* FALLTHROUGH */
+		case 'M': case 'm':	*rate *= 1024;	/* FALLTHROUGH */
+		case 'K': case 'k':	*rate *= 1024;
+					end++;
+		}
+
+		if (*end == '\0')
+			return 0;
+		if (*end != ',')
+			return -1;
+		spec = end + 1;
+	}
+}
+
+/*
+ * Give each listening address its own bucket.  With -R there are several
+ * listeners for each address; they share one.
+ */
+void
+shape_add_listener(addr)
+	struct sockaddr	*addr;
+{
+lsn_bucket_t	*lb;
+
+	lsn_buckets = realloc(lsn_buckets, (nlsn_buckets + 1) * sizeof(*lsn_buckets));
+	if (lsn_buckets == NULL) {
+		fprintf(stderr, "out of memory\n");
+		_exit(1);
+	}
+
+	lb = &lsn_buckets[nlsn_buckets++];
+	bzero(lb, sizeof(*lb));
+	bcopy(addr, &lb->lb_addr, addr->sa_family == AF_INET6
+		? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+	lb->lb_bucket.bk_rate = shape_listener;
+}
+
+/*
+ * Find the bucket for the address a new connection was accepted on.
+ */
+lsn_bucket_t *
+shape_listener_bucket(fd)
+{
+struct sockaddr_storage	 ss;
+socklen_t		 len = sizeof(ss);
+int			 i;
+
+	if (getsockname(fd, (struct sockaddr *) &ss, &len) == -1)
+		return NULL;
+
+	for (i = 0; i < nlsn_buckets; i++) {
+	struct sockaddr_storage	*la = &lsn_buckets[i].lb_addr;
+
+		if (la->ss_family != ss.ss_family)
+			continue;
+
+		if (ss.ss_family == AF_INET) {
+		struct sockaddr_in	*a = (void *) &ss, *b = (void *) la;
+
+			if (a->sin_port == b->sin_port
+			    && (b->sin_addr.s_addr == INADDR_ANY
+				|| a->sin_addr.s_addr == b->sin_addr.s_addr))
+				return &lsn_buckets[i];
+		} else if (ss.ss_family == AF_INET6) {
+		struct sockaddr_in6	*a = (void *) &ss, *b = (void *) la;
+
+			if (a->sin6_port == b->sin6_port
+			    && (IN6_IS_ADDR_UNSPECIFIED(&b->sin6_addr)
+				|| IN6_ARE_ADDR_EQUAL(&a->sin6_addr, &b->sin6_addr)))
+				return &lsn_buckets[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * How long (ns) until the bucket is within SHAPE_BURST of full.
+ */
+uint64_t
+bucket_wait(bk, now)
+	bucket_t	*bk;
+	uint64_t	 now;
+{
+uint64_t	tat;
+
+	if (bk->bk_rate == 0)
+		return 0;
+
+	tat = load_relaxed(&bk->bk_tat);
+	return tat > now + SHAPE_BURST ? tat - SHAPE_BURST - now : 0;
+}
+
+/*
+ * Take len bytes from the bucket.  A read can take it past empty; the client
+ * then waits until it's paid back.
+ */
+void
+bucket_charge(bk, now, len)
+	bucket_t	*bk;
+	uint64_t	 now;
+	size_t		 len;
+{
+uint64_t	tat, ntat, cost;
+
+	if (bk->bk_rate == 0)
+		return;
+
+	cost = (uint64_t) len * 1000000000 / bk->bk_rate;
+	tat = load_relaxed(&bk->bk_tat);
+	do {
+		ntat = (tat > now ? tat : now) + cost;
+	} while (!__atomic_compare_exchange_n(&bk->bk_tat, &tat, ntat, 1,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * A xorshift64* generator: cheap, and good enough for choosing outcomes.
+ */
+uint32_t
+thread_random(th)
+	thread_t	*th;
+{
+uint64_t	x = th->th_rng;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	th->th_rng = x;
+	return (x * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+/*
+ * Parse a policy like "defer=5,refuse=10,reject=2.5".  Returns -1 if it's
+ * invalid or the percentages add up to more than 100.
+ */
+int
+policy_parse(spec)
+	char const	*spec;
+{
+double		 defer = 0, refuse = 0, reject = 0, *pct;
+char		*end;
+
+	for (;;) {
+		if (strncmp(spec, "defer=", 6) == 0) {
+			pct = &defer;
+			spec += 6;
+		} else if (strncmp(spec, "refuse=", 7) == 0) {
+			pct = &refuse;
+			spec += 7;
+		} else if (strncmp(spec, "reject=", 7) == 0) {
+			pct = &reject;
+			spec += 7;
+		} else
+			return -1;
+
+		*pct = strtod(spec, &end);
+		if (end == spec || *pct < 0)
+			return -1;
+
+		if (*end == '\0')
+			break;
+		if (*end != ',')
+			return -1;
+		spec = end + 1;
+	}
+
+	if (defer + refuse + reject > 100)
+		return -1;
+
+	policy_defer = defer / 100 * 4294967296.;
+	policy_refuse = (defer + refuse) / 100 * 4294967296.;
+	policy_reject = (defer + refuse + reject) / 100 * 4294967296.;
+	return 0;
+}
+
+uint32_t
+thread_roll(th, msgid, len)
+	thread_t	*th;
+	char const	*msgid;
+	size_t		 len;
+{
+	if (policy_keyed)
+		return ((hist_hash(msgid, len) ^ policy_key)
+			* 0x9E3779B97F4A7C15ULL) >> 32;
+	return thread_random(th);
+}
+
+/*
+ * Choose the outcome for an offer of msgid under the -o policy.  This runs for
+ * every CHECK, so it's just a hash or a xorshift and three comparisons.  Each
+ * offer is rolled for once; an IHAVE article gets the outcome its offer got.
+ */
+int
+thread_policy(th, msgid, len)
+	thread_t	*th;
+	char const	*msgid;
+	size_t		 len;
+{
+uint32_t	roll;
+
+	if (!do_policy)
+		return PO_ACCEPT;
+
+	roll = thread_roll(th, msgid, len);
+	if (roll < policy_defer)
+		return PO_DEFER;
+	if (roll < policy_refuse)
+		return PO_REFUSE;
+	if (roll < policy_reject)
+		return PO_REJECT;
+	return PO_ACCEPT;
+}
+
+/*
+ * TAKETHIS can only be accepted or rejected, so only the reject share applies
+ * to it.  With -k, the roll is the one the message-ID got at CHECK, so the
+ * reject band picks out exactly the articles CHECK let through to be rejected.
+ * Otherwise, if the client CHECKs first, the defer and refuse shares have
+ * already been taken out of what it sends, so the reject share is scaled up
+ * to be a share of what's left; either way, reject% of offers are rejected.
+ */
+int
+thread_policy_takethis(th, flags, msgid, len)
+	thread_t	*th;
+	int		 flags;
+	char const	*msgid;
+	size_t		 len;
+{
+uint64_t	lo = policy_refuse, hi = policy_reject;
+uint32_t	roll;
+
+	if (!do_policy)
+		return PO_ACCEPT;
+
+	roll = thread_roll(th, msgid, len);
+	if (!policy_keyed) {
+		hi -= lo;
+		lo = 0;
+		if ((flags & CL_CHECKED) && policy_refuse
+		    && policy_refuse < 4294967296ULL)
+			hi = (hi << 32) / (4294967296ULL - policy_refuse);
+	}
+
+	return roll >= lo && roll < hi ? PO_REJECT : PO_ACCEPT;
+}
+
+void
+thread_wakeup(loop, w, revents)
+	struct ev_loop	*loop;
+	ev_async	*w;
+{
+thread_t	*th = w->data;
+	thread_accept(th);
+	thread_adopt(th);
+}
+
+void
+thread_accept(th)
+	thread_t	*th;
+{
+unsigned	head = th->th_aq_head,
+		tail = load_acquire(&th->th_aq_tail);
+int		fd;
+
+	while (head != tail) {
+		fd = th->th_acceptq[head % ACCEPTQ_SIZE];
+		store_release(&th->th_aq_head, ++head);
+		client_new(th, fd);
+	}
+}
+
+/*
+ * Give a new connection to the thread chosen by the placement policy, or if
+ * its queue is full, the next thread with room.  The thread isn't woken here;
+ * the caller does that once per batch.
+ */
+int
+thread_handoff(fd, addr)
+	struct sockaddr	*addr;
+{
+int	i;
+
+	if (thread_enqueue(thread_place(addr), fd) == 0)
+		return 0;
+
+	for (i = 0; i < nthreads; i++) {
+	thread_t	*th = &threads[next_thread];
+
+		if (++next_thread == nthreads)
+			next_thread = 0;
+
+		if (thread_enqueue(th, fd) == 0)
+			return 0;
+	}
+
+	return -1;
+}
+
+int
+thread_enqueue(th, fd)
+	thread_t	*th;
+{
+unsigned	tail = th->th_aq_tail;
+
+	if (tail - load_acquire(&th->th_aq_head) >= ACCEPTQ_SIZE)
+		return -1;
+
+	th->th_acceptq[tail % ACCEPTQ_SIZE] = fd;
+	store_release(&th->th_aq_tail, tail + 1);
+	th->th_aq_wake = 1;
+	return 0;
+}
+
+/*
+ * Hash the peer's address (not its port, so all connections from one host
+ * land on the same thread).
+ */
+static uint64_t
+addr_hash(addr)
+	struct sockaddr	*addr;
+{
+unsigned char const	*p;
+size_t			 len;
+uint64_t		 h = 0xCBF29CE484222325ULL;
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		p = (void *) &((struct sockaddr_in *) addr)->sin_addr;
+		len = sizeof(struct in_addr);
+		break;
+
+	case AF_INET6:
+		p = (void *) &((struct sockaddr_in6 *) addr)->sin6_addr;
+		len = sizeof(struct in6_addr);
+		break;
+
+	default:
+		return 0;
+	}
+
+	while (len--)
+		h = (h ^ *p++) * 0x100000001B3ULL;
+	return h;
+}
+
+/*
+ * Jump consistent hash (Lamping & Veach): map key to one of n buckets, such
+ * that changing n only moves the keys that have to move.
+ */
+static int
+jump_hash(key, n)
+	uint64_t	key;
+{
+int64_t	b = -1, j = 0;
+
+	while (j < n) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1));
+	}
+
+	return b;
+}
+
+/*
+ * The number of connections th has, or will have once it's accepted the ones
+ * waiting in its queue.
+ */
+static unsigned
+thread_conns(th)
+	thread_t	*th;
+{
+	return load_relaxed(&th->th_nclients)
+		+ (th->th_aq_tail - load_relaxed(&th->th_aq_head));
+}
+
+/*
+ * Return the least loaded thread other than skip (which may be NULL).  With
+ * -P rate, that's the thread reading the fewest bytes/sec; since rates are only
+ * updated every tick, threads whose rates are about the same are compared by
+ * connections, so a burst of new connections is still spread out.  Otherwise,
+ * it's the thread with the fewest connections.
+ */
+thread_t *
+thread_least_loaded(skip)
+	thread_t	*skip;
+{
+thread_t	*best = NULL;
+uint64_t	 minrate = UINT64_MAX, rate;
+int		 i;
+
+	if (placement == PL_RATE) {
+		for (i = 0; i < nthreads; i++) {
+			if (&threads[i] == skip)
+				continue;
+			if ((rate = load_relaxed(&threads[i].th_rate)) < minrate)
+				minrate = rate;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+	thread_t	*th = &threads[i];
+
+		if (th == skip)
+			continue;
+
+		if (placement == PL_RATE
+		    && load_relaxed(&th->th_rate) > minrate + minrate / 8 + RATE_SLACK)
+			continue;
+
+		if (!best || thread_conns(th) < thread_conns(best))
+			best = th;
+	}
+
+	return best;
+}
+
+thread_t *
+thread_place(addr)
+	struct sockaddr	*addr;
+{
+thread_t	*th;
+
+	switch (placement) {
+	case PL_CONN:
+	case PL_RATE:
+		return thread_least_loaded(NULL);
+
+	case PL_HASH:
+		return &threads[jump_hash(addr_hash(addr), nthreads)];
+
+	default:
+		th = &threads[next_thread];
+		if (++next_thread == nthreads)
+			next_thread = 0;
+		return th;
+	}
+}
+
+/*
+ * Start handling a newly accepted connection on th, which must be the calling
+ * thread.
+ */
+client_t *
+client_new(th, fd)
+	thread_t	*th;
+{
+client_t	*client;
+int		 one = 1;
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	client = xcalloc(1, sizeof(*client));
+	client->cl_fd = fd;
+	client_attach(th, client);
+	client->cl_rdbuf = cq_new(&th->th_pool);
+	client->cl_wrbuf = cq_new(&th->th_pool);
+	if (do_delay)
+		client->cl_delaybuf = cq_new(&th->th_pool);
+	client->cl_bucket.bk_rate = shape_conn;
+	if (shape_listener)
+		client->cl_lbucket = shape_listener_bucket(fd);
+
+	ev_io_init(&client->cl_readable, client_read, client->cl_fd, EV_READ);
+	client->cl_readable.data = client;
+
+	ev_io_init(&client->cl_writable, client_write, client->cl_fd, EV_WRITE);
+	client->cl_writable.data = client;
+
+#ifdef	USE_IO_URING
+	if (use_uring)
+		client_uring_recv(client);
+	else
+#endif
+		client_start_read(client);
+	client_send_lit(client, "200 nntpsink ready.\r\n");
+	client_flush_later(client);
+	return client;
+}
+
+/*
+ * Make th, which must be the calling thread, responsible for cl.
+ */
+void
+client_attach(th, cl)
+	thread_t	*th;
+	client_t	*cl;
+{
+	cl->cl_thread = th;
+	TAILQ_INSERT_TAIL(&th->th_clients, cl, cl_list);
+	store_relaxed(&th->th_nclients, th->th_nclients + 1);
+}
+
+/*
+ * A client can be migrated when it's between commands and we have nothing
+ * buffered for it in either direction, so the only state to move is the
+ * client itself.
+ */
+int
+client_idle(cl)
+	client_t	*cl;
+{
+	return !(cl->cl_flags & (CL_DEAD | CL_FLUSH | CL_READY | CL_PAUSED
+				 | CL_DELAYED | CL_SHAPED))
+		&& cl->cl_state == CL_NORMAL
+		&& cq_len(cl->cl_rdbuf) == 0
+		&& cq_len(cl->cl_wrbuf) == 0
+		&& !ev_is_active(&cl->cl_writable);
+}
+
+/*
+ * Move an idle client from the calling thread to another thread.  Its watchers
+ * are stopped here and restarted on the new thread's loop by thread_adopt();
+ * its (empty) buffers give their blocks back to our pool and take new ones
+ * from the new thread's.
+ */
+void
+client_migrate(cl, to)
+	client_t	*cl;
+	thread_t	*to;
+{
+thread_t	*th = cl->cl_thread;
+client_t	*head;
+
+	if (debug)
+		printf("[%d] migrating to thread %d\n", cl->cl_fd,
+		       (int) (to - threads));
+
+	client_stop_read(cl);
+	TAILQ_REMOVE(&th->th_clients, cl, cl_list);
+	store_relaxed(&th->th_nclients, th->th_nclients - 1);
+
+	cq_set_pool(cl->cl_rdbuf, &to->th_pool);
+	cq_set_pool(cl->cl_wrbuf, &to->th_pool);
+	if (cl->cl_delaybuf)
+		cq_set_pool(cl->cl_delaybuf, &to->th_pool);
+	cl->cl_thread = to;
+	cl->cl_nread = 0;
+
+	head = load_relaxed(&to->th_migrateq);
+	do {
+		cl->cl_next = head;
+	} while (!__atomic_compare_exchange_n(&to->th_migrateq, &head, cl, 1,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	ev_async_send(to->th_loop, &to->th_wakeup);
+}
+
+/*
+ * Take over any clients other threads have migrated to us.
+ */
+void
+thread_adopt(th)
+	thread_t	*th;
+{
+client_t	*cl, *next;
+
+	cl = __atomic_exchange_n(&th->th_migrateq, NULL, __ATOMIC_ACQUIRE);
+	while (cl) {
+		next = cl->cl_next;
+		client_attach(th, cl);
+		client_start_read(cl);
+		cl = next;
+	}
+}
+
+/*
+ * Move idle clients to the least loaded thread if we have noticeably more load
+ * than it.  With -P rate, move the idle client which read the most since the
+ * last rebalance, as long as that doesn't just move the imbalance to the other
+ * thread; otherwise, move enough clients to even out the connection counts.
+ */
+void
+thread_rebalance(th)
+	thread_t	*th;
+{
+thread_t	*to;
+client_t	*cl, *next, *best = NULL;
+uint64_t	 excess;
+int		 n;
+
+	if ((to = thread_least_loaded(th)) == NULL)
+		return;
+
+	if (placement == PL_RATE) {
+	uint64_t	rate = load_relaxed(&to->th_rate);
+
+		if (th->th_rate <= rate * 2 + RATE_SLACK)
+			goto done;
+
+		/* cl_nread covers the second since the last rebalance. */
+		excess = (th->th_rate - rate) / 2;
+		TAILQ_FOREACH(cl, &th->th_clients, cl_list)
+			if (client_idle(cl) && cl->cl_nread <= excess
+			    && (!best || cl->cl_nread > best->cl_nread))
+				best = cl;
+
+		if (best)
+			client_migrate(best, to);
+		goto done;
+	}
+
+	if ((n = (th->th_nclients - (int) thread_conns(to)) / 2) <= 0)
+		return;
+
+	for (cl = TAILQ_FIRST(&th->th_clients); cl && n; cl = next) {
+		next = TAILQ_NEXT(cl, cl_list);
+		if (!client_idle(cl))
+			continue;
+		client_migrate(cl, to);
+		n--;
+	}
+	return;
+
+done:
+	TAILQ_FOREACH(cl, &th->th_clients, cl_list)
+		cl->cl_nread = 0;
+}
+
+listener_t *
+listener_new(r, reuseport)
+	struct addrinfo	*r;
+{
+listener_t	*lsn = xcalloc(1, sizeof(*lsn));
+int		 fl, one = 1;
+char		 sname[NI_MAXHOST];
+
+	if ((lsn->ln_fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol)) == -1) {
+		fprintf(stderr, "%s:%s: socket: %s\n",
+			listen_host, port, strerror(errno));
+		goto err;
+	}
+
+	if ((fl = fcntl(lsn->ln_fd, F_GETFL, 0)) == -1) {
+		fprintf(stderr, "%s:%s: fgetfl: %s\n",
+			listen_host, port, strerror(errno));
+		goto err;
+	}
+
+	if (fcntl(lsn->ln_fd, F_SETFL, fl | O_NONBLOCK) == -1) {
+		fprintf(stderr, "%s:%s: fsetfl: %s\n",
+			listen_host, port, strerror(errno));
+		goto err;
+	}
+
+	if (setsockopt(lsn->ln_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+		fprintf(stderr, "%s:%s: setsockopt(TCP_NODELAY): %s\n",
+			listen_host, port, strerror(errno));
+		goto err;
+	}
+
+	if (setsockopt(lsn->ln_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
+		fprintf(stderr, "%s:%s: setsockopt(SO_REUSEADDR): %s\n",
+			listen_host, port, strerror(errno));
+		goto err;
+	}
+
+#ifdef	SO_REUSEPORT
+	if (reuseport &&
+	    setsockopt(lsn->ln_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+		fprintf(stderr, "%s:%s: setsockopt(SO_REUSEPORT): %s\n",
+			listen_host, port, strerror(errno));
+		goto err;
+	}
+#endif
+
+	if (bind(lsn->ln_fd, r->ai_addr, r->ai_addrlen) == -1) {
+		getnameinfo(r->ai_addr, r->ai_addrlen, sname, sizeof(sname),
+				NULL, 0, NI_NUMERICHOST);
+		fprintf(stderr, "%s[%s]:%s: bind: %s\n",
+			listen_host, sname, port, strerror(errno));
+		goto err;
+	}
+
+	if (listen(lsn->ln_fd, 128) == -1) {
+		fprintf(stderr, "%s:%s: listen: %s\n",
+			listen_host, port, strerror(errno));
+		goto err;
+	}
+
+	ev_io_init(&lsn->ln_readable, listener_accept, lsn->ln_fd, EV_READ);
+	lsn->ln_readable.data = lsn;
+	return lsn;
+
+err:
+	if (lsn->ln_fd != -1)
+		close(lsn->ln_fd);
+	free(lsn);
+	return NULL;
+}
+
+/*
+ * Steer each connection to the listener of the thread whose index matches the
+ * CPU that received it, so connection placement follows the NIC RX queue.
+ */
+void
+listener_steer(lsn)
+	listener_t	*lsn;
+{
+#ifdef	SO_ATTACH_REUSEPORT_CBPF
+struct sock_filter	code[] = {
+	{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+	{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, nthreads },
+	{ BPF_RET | BPF_A, 0, 0, 0 },
+};
+struct sock_fprog	prog;
+
+	prog.len = sizeof(code) / sizeof(*code);
+	prog.filter = code;
+
+	if (setsockopt(lsn->ln_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		       &prog, sizeof(prog)) == -1)
+		fprintf(stderr, "%s:%s: setsockopt(SO_ATTACH_REUSEPORT_CBPF): %s\n",
+			listen_host, port, strerror(errno));
+#else
+	fprintf(stderr, "%s:%s: connection steering not supported on this platform\n",
+		listen_host, port);
+#endif
+}
+
+void
+listener_accept(loop, w, revents)
+	struct ev_loop	*loop;
+	ev_io		*w;
+{
+int			 fd, i, n = 0;
+listener_t		*lsn = w->data;
+struct sockaddr_storage	 addr;
+socklen_t		 addrlen = sizeof(addr);
+
+	while (n++ < ACCEPT_BATCH &&
+	       (fd = accept_nb(lsn->ln_fd, (struct sockaddr *) &addr, &addrlen)) >= 0) {
+		addrlen = sizeof(addr);
+
+		if (lsn->ln_thread) {
+			client_new(lsn->ln_thread, fd);
+			continue;
+		}
+
+		if (thread_handoff(fd, (struct sockaddr *) &addr) == -1) {
+			fprintf(stderr, "accept: all threads are busy, dropping connection\n");
+			close(fd);
+		}
+	}
+
+	if (n <= ACCEPT_BATCH && !ignore_errno(errno))
+		fprintf(stderr, "accept: %s\n", strerror(errno));
+
+	if (lsn->ln_thread)
+		return;
+
+	for (i = 0; i < nthreads; i++) {
+		if (!threads[i].th_aq_wake)
+			continue;
+		threads[i].th_aq_wake = 0;
+		ev_async_send(threads[i].th_loop, &threads[i].th_wakeup);
+	}
+}
+
+/*
+ * Accept a connection, and make it non-blocking and close-on-exec.
+ */
+int
+accept_nb(fd, addr, addrlen)
+	struct sockaddr	*addr;
+	socklen_t	*addrlen;
+{
+#ifdef	SOCK_NONBLOCK
+	return accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+int	nfd, fl;
+
+	if ((nfd = accept(fd, addr, addrlen)) == -1)
+		return -1;
+
+	if ((fl = fcntl(nfd, F_GETFL, 0)) == -1
+	    || fcntl(nfd, F_SETFL, fl | O_NONBLOCK) == -1
+	    || fcntl(nfd, F_SETFD, FD_CLOEXEC) == -1) {
+		close(nfd);
+		return -1;
+	}
+
+	return nfd;
+#endif
+}
+
+void
+client_write(loop, w, revents)
+	struct ev_loop	*loop;
+	ev_io		*w;
+{
+client_t	*cl = w->data;
+
+	client_flush(cl);
+}
+
+void
+client_destroy(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+
+	TAILQ_REMOVE(&th->th_clients, cl, cl_list);
+	store_relaxed(&th->th_nclients, th->th_nclients - 1);
+	close(cl->cl_fd);
+	cq_free(cl->cl_rdbuf);
+	cq_free(cl->cl_wrbuf);
+	if (cl->cl_delaybuf)
+		cq_free(cl->cl_delaybuf);
+	free(cl->cl_delayed);
+	free(cl->cl_msgid);
+	spool_art_free(cl->cl_art);
+	free(cl);
+}
+
+void
+client_flush(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+struct ev_loop	*loop = th->th_loop;
+ssize_t		 n;
+size_t		 len, nwrite;
+
+	if (cl->cl_flags & CL_DEAD)
+		return;
+
+#ifdef	USE_IO_URING
+	if (use_uring) {
+		client_uring_send(cl);
+		return;
+	}
+#endif
+
+	if (cq_len(cl->cl_wrbuf) == 0) {
+		ev_io_stop(loop, &cl->cl_writable);
+		return;
+	}
+
+	len = cq_len(cl->cl_wrbuf);
+	nwrite = cl->cl_wrbuf->cq_nwrite;
+	n = cq_write(cl->cl_wrbuf, cl->cl_fd);
+	thread_count(th, tc_nwrite, cl->cl_wrbuf->cq_nwrite - nwrite);
+	thread_count(th, tc_nwritten, len - cq_len(cl->cl_wrbuf));
+
+	if (n < 0 && !ignore_errno(errno)) {
+		printf("[%d] write error: %s\n",
+			cl->cl_fd, strerror(errno));
+		client_close(cl);
+		return;
+	}
+
+	if (cl->cl_flags & CL_PAUSED) {
+		if (client_outlen(cl) <= write_low)
+			client_resume(cl);
+	} else if (client_backlogged(cl))
+		client_pause(cl);
+
+	if (n < 0)
+		ev_io_start(loop, &cl->cl_writable);
+	else
+		ev_io_stop(loop, &cl->cl_writable);
+}
+
+/*
+ * Flush the client once the current loop iteration is done.  With -c, this is
+ * how all replies are sent, so a client which receives several commands in one
+ * iteration gets all its replies in a single write.
+ */
+void
+client_flush_later(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+
+	if (!do_coalesce) {
+		client_flush(cl);
+		return;
+	}
+
+	if (cl->cl_flags & (CL_DEAD | CL_FLUSH))
+		return;
+
+	cl->cl_flags |= CL_FLUSH;
+	cl->cl_flush_next = th->th_flushlist;
+	th->th_flushlist = cl;
+}
+
+void
+thread_flush(loop, w, revents)
+	struct ev_loop	*loop;
+	ev_prepare	*w;
+{
+thread_t	*th = w->data;
+client_t	*cl, *next;
+
+	cl = th->th_flushlist;
+	th->th_flushlist = NULL;
+
+	while (cl) {
+		next = cl->cl_flush_next;
+		cl->cl_flags &= ~CL_FLUSH;
+		client_flush(cl);
+		cl = next;
+	}
+
+#ifdef	USE_IO_URING
+	if (use_uring && ur_submit(&th->th_ring) == -1 && errno != EAGAIN
+	    && errno != EBUSY && errno != EINTR) {
+		fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+		_exit(1);
+	}
+#endif
+}
+
+void
+client_close(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+struct ev_loop	*loop = th->th_loop;
+
+	if (cl->cl_flags & CL_DEAD)
+		return;
+
+	ev_io_stop(loop, &cl->cl_writable);
+	client_stop_read(cl);
+	cl->cl_flags |= CL_DEAD;
+
+	if (cl->cl_flags & CL_READY) {
+		TAILQ_REMOVE(&th->th_ready, cl, cl_ready_list);
+		th->th_nready--;
+		cl->cl_flags &= ~CL_READY;
+	}
+
+	if (cl->cl_flags & CL_DELAYED)
+		client_wheel_remove(cl);
+
+	if (cl->cl_flags & CL_SHAPED)
+		client_unshape(cl);
+
+#ifdef	USE_IO_URING
+	/* Make any outstanding operations complete. */
+	if (use_uring)
+		shutdown(cl->cl_fd, SHUT_RDWR);
+#endif
+
+	cl->cl_next = th->th_deadlist;
+	th->th_deadlist = cl;
+}
+
+void
+client_sendn(cl, s, len)
+	client_t	*cl;
+	char const	*s;
+	size_t		 len;
+{
+	if (cl->cl_flags & CL_DELAYED) {
+		client_delay_append(cl, s, len);
+		return;
+	}
+
+	cq_append(cl->cl_wrbuf, s, len);
+	if (!do_coalesce && cq_len(cl->cl_wrbuf) > 1024)
+		client_flush(cl);
+}
+
+/*
+ * Send "<code> <msgid>\r\n".  This is the reply to nearly every command, so
+ * it's built directly in the write queue rather than going through printf.
+ */
+void
+client_reply(cl, code, msgid, len)
+	client_t	*cl;
+	char const	*msgid;
+	size_t		 len;
+{
+charq_t	*q = do_delay ? cl->cl_delaybuf : cl->cl_wrbuf;
+char	*p;
+
+	if (p = cq_reserve(q, len + 6)) {
+		p[0] = '0' + code / 100;
+		p[1] = '0' + code / 10 % 10;
+		p[2] = '0' + code % 10;
+		p[3] = ' ';
+		bcopy(msgid, p + 4, len);
+		p[len + 4] = '\r';
+		p[len + 5] = '\n';
+		cq_commit(q, len + 6);
+	} else {
+	char	hdr[4];
+		hdr[0] = '0' + code / 100;
+		hdr[1] = '0' + code / 10 % 10;
+		hdr[2] = '0' + code % 10;
+		hdr[3] = ' ';
+		cq_append(q, hdr, sizeof(hdr));
+		cq_append(q, msgid, len);
+		cq_append(q, "\r\n", 2);
+	}
+
+	if (do_delay) {
+		client_delay(cl, len + 6);
+		return;
+	}
+
+	if (!do_coalesce && cq_len(cl->cl_wrbuf) > 1024)
+		client_flush(cl);
+}
+
+void
+client_vprintf(client_t *cl, char const *fmt, va_list ap)
+{
+char	line[1024];
+int	n;
+	n = vsnprintf(line, sizeof(line), fmt, ap);
+	if (n >= (int) sizeof(line))
+		n = sizeof(line) - 1;
+	if (cl->cl_flags & CL_DELAYED) {
+		client_delay_append(cl, line, n);
+		return;
+	}
+	cq_append(cl->cl_wrbuf, line, n);
+	if (!do_coalesce && cq_len(cl->cl_wrbuf) > 1024)
+		client_flush(cl);
+}
+
+void
+client_printf(client_t *cl, char const *fmt, ...)
+{
+va_list	ap;
+	va_start(ap, fmt);
+	client_vprintf(cl, fmt, ap);
+	va_end(ap);
+}
+
+void
+client_read(loop, w, revents)
+	struct ev_loop	*loop;
+	ev_io		*w;
+{
+	client_service(w->data);
+}
+
+/*
+ * Read from the client and handle what it sent, until its socket is drained or
+ * it's used up its budget for this round.  If it stops with commands still
+ * waiting, or with -e, where we won't hear about the socket again until more
+ * data arrives, it goes on the thread's ready list to be serviced again once
+ * everyone else has had a turn.  Without -e, a client which used up its byte
+ * budget is left for the event loop to report again.
+ */
+void
+client_service(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+size_t		 nread = 0, want;
+ssize_t		 n;
+
+	if (cl->cl_flags & CL_DEAD)
+		return;
+
+	if (cl->cl_flags & CL_READY) {
+		TAILQ_REMOVE(&th->th_ready, cl, cl_ready_list);
+		th->th_nready--;
+		cl->cl_flags &= ~CL_READY;
+	}
+
+	cl->cl_nlines = 0;
+
+	/* Handle anything left over from last time first. */
+	if (cq_len(cl->cl_rdbuf) && client_process(cl))
+		goto over;
+
+	while (!(cl->cl_flags & (CL_DEAD | CL_PAUSED))
+	       && (read_budget == 0 || nread < read_budget)
+	       && (max_input == 0 || cq_len(cl->cl_rdbuf) < max_input)) {
+		if (do_shape && client_shape(cl))
+			return;
+
+		/*
+		 * With -d, an article body which isn't already partly
+		 * buffered is discarded straight from the socket.
+		 */
+		if (do_blind && cq_len(cl->cl_rdbuf) == 0
+		    && (cl->cl_state == CL_TAKETHIS || cl->cl_state == CL_IHAVE)) {
+			if ((n = client_discard(cl)) <= 0)
+				return;
+			if (do_shape)
+				client_charge(cl, n);
+			nread += n;
+			if (!do_edge && n < BLIND_BUFSZ
+			    && cl->cl_state != CL_NORMAL)
+				return;
+			continue;
+		}
+
+		want = cq_read_size(cl->cl_rdbuf);
+		if ((n = cq_read(cl->cl_rdbuf, cl->cl_fd)) == -1) {
+			if (ignore_errno(errno))
+				return;
+			printf("[%d] read error: %s\n",
+				cl->cl_fd, strerror(errno));
+			client_close(cl);
+			return;
+		}
+
+		if (n == 0) {
+			client_close(cl);
+			return;
+		}
+
+		thread_count(th, tc_nread, n);
+		cl->cl_nread += n;
+		nread += n;
+		if (do_shape)
+			client_charge(cl, n);
+
+		if (client_process(cl))
+			goto over;
+
+		/*
+		 * A short read means the socket is empty; without -e, save
+		 * ourselves the read that would return EAGAIN.
+		 */
+		if (!do_edge && (size_t) n < want)
+			return;
+	}
+
+	if (cl->cl_flags & (CL_DEAD | CL_PAUSED))
+		return;
+
+	if (!do_edge) {
+		thread_count(th, tc_nbudget, 1);
+		return;
+	}
+
+over:
+	thread_count(th, tc_nbudget, 1);
+	client_ready(cl);
+}
+
+/*
+ * Put the client on the ready list, to be serviced on the next loop iteration.
+ */
+void
+client_ready(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+
+	if (cl->cl_flags & (CL_READY | CL_DEAD))
+		return;
+
+	TAILQ_INSERT_TAIL(&th->th_ready, cl, cl_ready_list);
+	th->th_nready++;
+	cl->cl_flags |= CL_READY;
+	ev_check_start(th->th_loop, &th->th_ready_ev);
+	ev_idle_start(th->th_loop, &th->th_idle_ev);
+}
+
+/*
+ * Whether the client has so much output waiting, after we've written as much
+ * as it would take, that we should stop reading its commands.  Replies held
+ * back by -T count too, or a client pipelining commands under a long delay
+ * could make us hold any number of them.
+ */
+int
+client_backlogged(cl)
+	client_t	*cl;
+{
+size_t	len = client_outlen(cl);
+
+	if (write_high && len >= write_high)
+		return 1;
+	if (mem_cap && len > write_low && load_relaxed(&mem_inuse) > mem_cap)
+		return 1;
+	return 0;
+}
+
+void
+client_pause(cl)
+	client_t	*cl;
+{
+	client_stop_read(cl);
+	cl->cl_flags |= CL_PAUSED;
+}
+
+/*
+ * Start reading from a paused client again.  It may have stopped with
+ * commands already buffered, so it's serviced again even if nothing more
+ * arrives.
+ */
+void
+client_resume(cl)
+	client_t	*cl;
+{
+	cl->cl_flags &= ~CL_PAUSED;
+	if (!(cl->cl_flags & CL_SHAPED))
+		client_start_read(cl);
+	if (cq_len(cl->cl_rdbuf))
+		client_ready(cl);
+}
+
+/*
+ * Service the clients which were on the ready list at the start of this loop
+ * iteration; any which are still ready afterwards wait for the next one.
+ */
+void
+thread_ready(loop, w, revents)
+	struct ev_loop	*loop;
+	ev_check	*w;
+{
+thread_t	*th = w->data;
+int		 n = th->th_nready;
+client_t	*cl;
+
+	while (n-- && (cl = TAILQ_FIRST(&th->th_ready)))
+		client_service(cl);
+
+	if (th->th_nready == 0) {
+		ev_check_stop(loop, &th->th_ready_ev);
+		ev_idle_stop(loop, &th->th_idle_ev);
+	}
+}
+
+/* Only here to keep the loop from blocking while clients are ready. */
+void
+thread_idle(loop, w, revents)
+	struct ev_loop	*loop;
+	ev_idle		*w;
+{
+}
+
+#ifdef	HAVE_SYS_EPOLL_H
+void
+thread_edge(loop, w, revents)
+	struct ev_loop	*loop;
+	ev_io		*w;
+{
+thread_t		*th = w->data;
+struct epoll_event	 evs[EDGE_BATCH];
+int			 i, n;
+
+	if ((n = epoll_wait(th->th_epfd, evs, EDGE_BATCH, 0)) == -1) {
+		if (errno != EINTR)
+			fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		client_service(evs[i].data.ptr);
+}
+#endif
+
+/*
+ * Start or stop watching the client for reading, with libev or (with -e) the
+ * thread's epoll set.
+ */
+void
+client_start_read(cl)
+	client_t	*cl;
+{
+thread_t		*th = cl->cl_thread;
+
+#ifdef	HAVE_SYS_EPOLL_H
+	if (do_edge) {
+	struct epoll_event	ev;
+
+		bzero(&ev, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = cl;
+		if (epoll_ctl(th->th_epfd, EPOLL_CTL_ADD, cl->cl_fd, &ev) == -1) {
+			printf("[%d] epoll_ctl: %s\n", cl->cl_fd, strerror(errno));
+			client_close(cl);
+		}
+		return;
+	}
+#endif
+
+	ev_io_start(th->th_loop, &cl->cl_readable);
+}
+
+void
+client_stop_read(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+
+#ifdef	HAVE_SYS_EPOLL_H
+	if (do_edge) {
+		epoll_ctl(th->th_epfd, EPOLL_CTL_DEL, cl->cl_fd, NULL);
+		return;
+	}
+#endif
+
+	ev_io_stop(th->th_loop, &cl->cl_readable);
+}
+
+/*
+ * Discard article body data without reading it into the client's buffer.
+ * We still have to look at the data to find the terminator, so it's peeked
+ * into the thread's scratch buffer (which stays in cache) and scanned there;
+ * then exactly the bytes up to the end of the body are dropped from the socket
+ * with MSG_TRUNC, which doesn't copy them again.  Returns the number of bytes
+ * discarded, 0 if there was nothing to read, or -1 if the client was closed.
+ */
+ssize_t
+client_discard(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+ssize_t		 n, end;
+size_t		 len;
+
+	if ((n = recv(cl->cl_fd, th->th_scratch, BLIND_BUFSZ, MSG_PEEK)) <= 0) {
+		if (n == -1 && ignore_errno(errno))
+			return 0;
+		if (n == -1)
+			printf("[%d] read error: %s\n",
+				cl->cl_fd, strerror(errno));
+		client_close(cl);
+		return -1;
+	}
+
+	end = cq_scan_body(&cl->cl_body, th->th_scratch, n);
+	len = end == -1 ? (size_t) n : (size_t) end;
+
+#ifdef	__linux__
+	n = recv(cl->cl_fd, NULL, len, MSG_TRUNC);
+#else
+	n = recv(cl->cl_fd, th->th_scratch, len, 0);
+#endif
+	if (n != (ssize_t) len) {
+		printf("[%d] read error: %s\n", cl->cl_fd,
+			n == -1 ? strerror(errno) : "short read");
+		client_close(cl);
+		return -1;
+	}
+
+	thread_count(th, tc_nread, len);
+	cl->cl_nread += len;
+	cl->cl_body.cqb_len += len;
+
+	if (end != -1) {
+		client_article_done(cl);
+		client_flush_later(cl);
+	}
+	return len;
+}
+
+/*
+ * The client is about to send the article msgid, which the policy has already
+ * decided the outcome of.  If we're spooling, the body scanner copies it into
+ * cl_art as it goes.
+ */
+void
+client_article_start(cl, state, policy, msgid, len)
+	client_t	*cl;
+	client_state_t	 state;
+	int		 policy;
+	char const	*msgid;
+	size_t		 len;
+{
+	/* The message-ID may contain a NUL, so copy exactly len bytes. */
+	cl->cl_msgid = xmalloc(len + 1);
+	bcopy(msgid, cl->cl_msgid, len);
+	cl->cl_msgid[len] = 0;
+	cl->cl_msgidlen = len;
+	cl->cl_state = state;
+	cl->cl_policy = policy;
+	cq_body_init(&cl->cl_body);
+	cl->cl_body.cqb_maxline = max_artline;
+
+	if (spool) {
+		cl->cl_art = spool_art_new(spool, msgid, len);
+		cl->cl_body.cqb_save = spool_art_save;
+		cl->cl_body.cqb_udata = cl->cl_art;
+	}
+}
+
+/*
+ * -T: the last len bytes of cl_delaybuf are a reply; hold it until it's due.
+ */
+void
+client_delay(cl, len)
+	client_t	*cl;
+	size_t		 len;
+{
+thread_t	*th = cl->cl_thread;
+delayed_t	*dl;
+uint64_t	 due;
+unsigned	 i;
+
+	if (cl->cl_flags & CL_DEAD)
+		return;
+
+	due = (uint64_t) (ev_now(th->th_loop) * 1000) + delay_ms;
+	if (delay_jitter)
+		due += thread_random(th) % (delay_jitter + 1);
+	if (due < cl->cl_due)
+		due = cl->cl_due;
+	cl->cl_due = due;
+
+	if (cl->cl_dtail - cl->cl_dhead == cl->cl_dsize) {
+	delayed_t	*ring;
+	unsigned	 nsize = cl->cl_dsize ? cl->cl_dsize * 2 : 64;
+
+		ring = xmalloc(nsize * sizeof(*ring));
+		for (i = 0; i < cl->cl_dsize; i++)
+			ring[i] = cl->cl_delayed[(cl->cl_dhead + i) & (cl->cl_dsize - 1)];
+		free(cl->cl_delayed);
+		cl->cl_delayed = ring;
+		cl->cl_dtail -= cl->cl_dhead;
+		cl->cl_dhead = 0;
+		cl->cl_dsize = nsize;
+	}
+
+	dl = &cl->cl_delayed[cl->cl_dtail++ & (cl->cl_dsize - 1)];
+	dl->dl_due = due;
+	dl->dl_len = len;
+
+	if (!(cl->cl_flags & CL_DELAYED))
+		client_wheel_add(cl, due);
+}
+
+/*
+ * Other output has to wait behind delayed replies; send it with the newest.
+ */
+void
+client_delay_append(cl, s, len)
+	client_t	*cl;
+	char const	*s;
+	size_t		 len;
+{
+	cq_append(cl->cl_delaybuf, s, len);
+	cl->cl_delayed[(cl->cl_dtail - 1) & (cl->cl_dsize - 1)].dl_len += len;
+}
+
+void
+client_wheel_add(cl, due)
+	client_t	*cl;
+	uint64_t	 due;
+{
+thread_t	*th = cl->cl_thread;
+
+	if (th->th_nwheel++ == 0) {
+		th->th_wheel_now = ev_now(th->th_loop) * 1000;
+		ev_timer_again(th->th_loop, &th->th_wheel_ev);
+	}
+
+	/* If it's already due, it goes in the next slot to be processed. */
+	if (due <= th->th_wheel_now)
+		due = th->th_wheel_now + 1;
+
+	cl->cl_wheel_slot = due % WHEEL_SLOTS;
+	TAILQ_INSERT_TAIL(&th->th_wheel[cl->cl_wheel_slot], cl, cl_wheel_list);
+	cl->cl_flags |= CL_DELAYED;
+}
+
+void
+client_wheel_remove(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+
+	TAILQ_REMOVE(&th->th_wheel[cl->cl_wheel_slot], cl, cl_wheel_list);
+	cl->cl_flags &= ~CL_DELAYED;
+	if (--th->th_nwheel == 0)
+		ev_timer_stop(th->th_loop, &th->th_wheel_ev);
+}
+
+/*
+ * Move every reply due by now to the write queue in one go, and put the client
+ * back on the wheel if it has any left.
+ */
+void
+client_release(cl, now)
+	client_t	*cl;
+	uint64_t	 now;
+{
+delayed_t	*dl;
+size_t		 len = 0;
+
+	client_wheel_remove(cl);
+
+	while (cl->cl_dhead != cl->cl_dtail) {
+		dl = &cl->cl_delayed[cl->cl_dhead & (cl->cl_dsize - 1)];
+		if (dl->dl_due > now)
+			break;
+		len += dl->dl_len;
+		cl->cl_dhead++;
+	}
+
+	cq_move(cl->cl_wrbuf, cl->cl_delaybuf, len);
+
+	if (cl->cl_dhead != cl->cl_dtail)
+		client_wheel_add(cl, cl->cl_delayed[cl->cl_dhead & (cl->cl_dsize - 1)].dl_due);
+
+	client_flush_later(cl);
+}
+
+/*
+ * Advance the timer wheel to the current time, releasing replies as they come
+ * due.  This runs every millisecond while any client has delayed replies.
+ */
+void
+thread_wheel(loop, w, revents)
+	struct ev_loop	*loop;
+	ev_timer	*w;
+{
+thread_t		*th = w->data;
+uint64_t		 now = ev_now(loop) * 1000;
+struct client_list	*slot;
+client_t		*cl, *next;
+
+	while (th->th_nwheel && th->th_wheel_now < now) {
+		th->th_wheel_now++;
+		slot = &th->th_wheel[th->th_wheel_now % WHEEL_SLOTS];
+
+		for (cl = TAILQ_FIRST(slot); cl; cl = next) {
+			next = TAILQ_NEXT(cl, cl_wheel_list);
+			if (cl->cl_delayed[cl->cl_dhead & (cl->cl_dsize - 1)].dl_due
+			    <= th->th_wheel_now)
+				client_release(cl, th->th_wheel_now);
+		}
+	}
+}
+
+/*
+ * -n: if any of the client's buckets is empty, stop reading from it until
+ * they've refilled, and return 1.
+ */
+int
+client_shape(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+uint64_t	 now = ev_now(th->th_loop) * 1e9, wait, w;
+
+	wait = bucket_wait(&cl->cl_bucket, now);
+	if (cl->cl_lbucket
+	    && (w = bucket_wait(&cl->cl_lbucket->lb_bucket, now)) > wait)
+		wait = w;
+	if ((w = bucket_wait(&shape_global, now)) > wait)
+		wait = w;
+
+	if (wait == 0)
+		return 0;
+
+	cl->cl_shaped_until = now + wait;
+	if (cl->cl_flags & CL_SHAPED)
+		return 1;
+
+	client_stop_read(cl);
+	cl->cl_flags |= CL_SHAPED;
+	if (TAILQ_EMPTY(&th->th_shaped))
+		ev_timer_again(th->th_loop, &th->th_shape_ev);
+	TAILQ_INSERT_TAIL(&th->th_shaped, cl, cl_shaped_list);
+	thread_count(th, tc_nshaped, 1);
+	return 1;
+}
+
+void
+client_charge(cl, len)
+	client_t	*cl;
+	size_t		 len;
+{
+uint64_t	now = ev_now(cl->cl_thread->th_loop) * 1e9;
+
+	bucket_charge(&cl->cl_bucket, now, len);
+	if (cl->cl_lbucket) {
+		bucket_charge(&cl->cl_lbucket->lb_bucket, now, len);
+		__atomic_fetch_add(&cl->cl_lbucket->lb_nread, len, __ATOMIC_RELAXED);
+	}
+	bucket_charge(&shape_global, now, len);
+}
+
+void
+client_unshape(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+
+	TAILQ_REMOVE(&th->th_shaped, cl, cl_shaped_list);
+	cl->cl_flags &= ~CL_SHAPED;
+	if (TAILQ_EMPTY(&th->th_shaped))
+		ev_timer_stop(th->th_loop, &th->th_shape_ev);
+}
+
+/*
+ * Start reading again from throttled clients whose buckets have refilled.
+ */
+void
+thread_shape(loop, w, revents)
+	struct ev_loop	*loop;
+	ev_timer	*w;
+{
+thread_t	*th = w->data;
+uint64_t	 now = ev_now(loop) * 1e9;
+client_t	*cl, *next;
+
+	for (cl = TAILQ_FIRST(&th->th_shaped); cl; cl = next) {
+		next = TAILQ_NEXT(cl, cl_shaped_list);
+		if (cl->cl_shaped_until > now)
+			continue;
+
+		client_unshape(cl);
+		if (!(cl->cl_flags & CL_PAUSED))
+			client_start_read(cl);
+	}
+}
+
+/*
+ * The client has finished sending an article; accept it.
+ */
+void
+client_article_done(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+int		 po;
+
+	if (debug)
+		printf("[%d] <- [%lu byte article]\n", cl->cl_fd,
+		       (unsigned long) cl->cl_body.cqb_len);
+
+	/* Not counting the terminating "." line. */
+	hg_add(&th->th_artbytes, cl->cl_body.cqb_len - cl->cl_body.cqb_termlen);
+	hg_add(&th->th_artlines, cl->cl_body.cqb_nlines - 1);
+
+	po = cl->cl_body.cqb_toolong ? PO_REJECT : cl->cl_policy;
+
+	if (po == PO_ACCEPT && history
+	    && hist_add(history, hist_hash(cl->cl_msgid, cl->cl_msgidlen),
+			ev_now(th->th_loop)))
+		po = PO_REJECT;
+
+	switch (po) {
+	case PO_ACCEPT:
+		client_reply(cl, cl->cl_state == CL_IHAVE ? 235 : 239,
+			     cl->cl_msgid, cl->cl_msgidlen);
+		thread_count(th, tc_naccepted, 1);
+
+		if (cl->cl_art) {
+			spool_submit(spool, cl->cl_art, cl->cl_body.cqb_termlen);
+			cl->cl_art = NULL;
+		}
+		break;
+
+	default:
+		/* 437 <msg-id> -- IHAVE, rejected */
+		client_reply(cl, cl->cl_state == CL_IHAVE ? 437 : 439,
+			     cl->cl_msgid, cl->cl_msgidlen);
+		thread_count(th, tc_nreject, 1);
+		break;
+	}
+
+	spool_art_free(cl->cl_art);
+	cl->cl_art = NULL;
+
+	free(cl->cl_msgid);
+	cl->cl_msgid = NULL;
+	cl->cl_state = CL_NORMAL;
+	thread_count(th, tc_nresp, 1);
+}
+
+/*
+ * The client sent a command line longer than we accept; the caller has thrown
+ * it away.
+ */
+void
+client_line_too_long(cl)
+	client_t	*cl;
+{
+	if (debug)
+		printf("[%d] <- [line too long]\n", cl->cl_fd);
+
+	client_send_lit(cl, "500 Line too long.\r\n");
+	thread_count(cl->cl_thread, tc_nresp, 1);
+	cl->cl_nlines++;
+}
+
+/*
+ * Handle whatever commands and article data have arrived in the client's read
+ * buffer.  Returns 1 if it stopped because the client used up its line budget,
+ * otherwise 0.
+ */
+int
+client_process(cl)
+	client_t	*cl;
+{
+thread_t	*th = cl->cl_thread;
+char		*ln;
+size_t		 len;
+int		 over = 0;
+
+	for (;;) {
+		/*
+		 * Replies usually go out as we make them, so this only
+		 * catches replies which are being coalesced or delayed; the
+		 * others are caught in client_flush().
+		 */
+		if (!(cl->cl_flags & CL_PAUSED) && write_high
+		    && client_outlen(cl) >= write_high)
+			client_pause(cl);
+
+		if (cl->cl_flags & CL_PAUSED)
+			break;
+
+		if (line_budget && cl->cl_nlines >= line_budget) {
+			over = cq_len(cl->cl_rdbuf) > 0;
+			break;
+		}
+
+		if (cl->cl_state == CL_SKIPLINE) {
+			if (!cq_discard_line(cl->cl_rdbuf))
+				break;
+			cl->cl_state = CL_NORMAL;
+			continue;
+		}
+
+		if (cl->cl_state == CL_TAKETHIS || cl->cl_state == CL_IHAVE) {
+			/*
+			 * We don't care about the article itself, so skip
+			 * straight to the terminating "." without looking at
+			 * individual lines.
+			 */
+			if (!cq_discard_body(cl->cl_rdbuf, &cl->cl_body))
+				break;
+
+			client_article_done(cl);
+			cl->cl_nlines++;
+			continue;
+		}
+
+		if ((ln = cq_borrow_line(cl->cl_rdbuf, &len)) == NULL) {
+			if (max_cmdline && cq_len(cl->cl_rdbuf) >= max_cmdline) {
+				/* Throw away the rest of the line as it arrives. */
+				cq_remove_start(cl->cl_rdbuf, cq_len(cl->cl_rdbuf));
+				cl->cl_state = CL_SKIPLINE;
+				client_line_too_long(cl);
+				continue;
+			}
+			break;
+		}
+
+		if (max_cmdline && cl->cl_rdbuf->cq_borrowed > max_cmdline) {
+			cq_release_line(cl->cl_rdbuf);
+			client_line_too_long(cl);
+			continue;
+		}
+
+		if (debug)
+			printf("[%d] <- [%s]\n", cl->cl_fd, ln);
+
+		/*
+		 * 238 <msg-id> -- CHECK, send the article
+		 * 431 <msg-id> -- CHECK, defer the article
+		 * 438 <msg-id> -- CHECK, never send the article
+		 * 239 <msg-id> -- TAKETHIS, accepted
+		 * 439 <msg-id> -- TAKETHIS, rejected
+		 * 335 <msg-id> -- IHAVE, send the article
+		 * 435 <msg-id> -- IHAVE, never send the article
+		 * 436 <msg-id> -- IHAVE, defer the article
+		 */
+
+		cmd_dispatch(cl, ln, len);
+
+		cq_release_line(cl->cl_rdbuf);
+		if (cl->cl_flags & CL_DEAD)
+			return 0;
+		if (cl->cl_state == CL_NORMAL || cl->cl_state == CL_IHAVE)
+			thread_count(th, tc_nresp, 1);
+		cl->cl_nlines++;
+	}
+
+	client_flush_later(cl);
+	return over;
+}
+
+#define	cmd_hashkey(key, len) \
+	((((key) ^ (len)) * 0x9E3779B97F4A7C15ULL) >> (64 - CMD_HASHBITS))
+
 void
-client_write(loop, w, revents)
-	struct ev_loop	*loop;
-	ev_io		*w;
+cmd_init()
 {
-client_t	*cl = w->data;
+size_t	i, j, h;
 
-	client_flush(cl);
+	for (i = 0; i < sizeof(commands) / sizeof(*commands); i++) {
+	command_t	*cm = &commands[i];
+
+		cm->cm_len = strlen(cm->cm_name);
+		for (j = 0; j < cm->cm_len && j < 8; j++)
+			cm->cm_key |= (uint64_t) (unsigned char) cm->cm_name[j] << (j * 8);
+
+		for (h = cmd_hashkey(cm->cm_key, cm->cm_len); cmd_hash[h];
+		     h = (h + 1) % CMD_HASHSZ)
+			;
+		cmd_hash[h] = cm;
+	}
 }
 
 void
-client_destroy(cl)
+cmd_dispatch(cl, ln, len)
 	client_t	*cl;
+	char		*ln;
+	size_t		 len;
 {
-	close(cl->cl_fd);
-	cq_free(cl->cl_rdbuf);
-	cq_free(cl->cl_wrbuf);
-	free(cl->cl_msgid);
-	free(cl);
+command_t	*cm;
+uint64_t	 key = 0;
+size_t		 cmdlen, h;
+char		*data;
+
+	/*
+	 * Upper-case the command and build its key in one pass.
+	 */
+	for (cmdlen = 0; cmdlen < len && ln[cmdlen] != ' '; cmdlen++) {
+		if (ln[cmdlen] >= 'a' && ln[cmdlen] <= 'z')
+			ln[cmdlen] -= 'a' - 'A';
+		if (cmdlen < 8)
+			key |= (uint64_t) (unsigned char) ln[cmdlen] << (cmdlen * 8);
+	}
+
+	data = NULL;
+	if (cmdlen < len) {
+		ln[cmdlen] = 0;
+		data = ln + cmdlen + 1;
+		while (isspace(*data))
+			data++;
+		if (!*data)
+			data = NULL;
+	}
+
+	for (h = cmd_hashkey(key, cmdlen); cm = cmd_hash[h];
+	     h = (h + 1) % CMD_HASHSZ) {
+		if (cm->cm_key == key && cm->cm_len == cmdlen &&
+		    (cmdlen <= 8 || memcmp(cm->cm_name, ln, cmdlen) == 0))
+			break;
+	}
+
+	if (!cm || ((cm->cm_flags & CM_STREAMING) && !do_streaming)
+	    || ((cm->cm_flags & CM_IHAVE) && !do_ihave)) {
+		client_send_lit(cl, "500 Unknown command.\r\n");
+		return;
+	}
+
+	if ((cm->cm_flags & CM_NEEDARG) && !data) {
+		client_send_lit(cl, "501 Missing message-id.\r\n");
+		return;
+	}
+
+	cm->cm_handler(cl, data, data ? ln + len - data : 0);
 }
 
 void
-client_flush(cl)
+cmd_capabilities(cl, data, len)
 	client_t	*cl;
+	char		*data;
+	size_t		 len;
 {
-thread_t	*th = cl->cl_thread;
-struct ev_loop	*loop = th->th_loop;
+	client_printf(cl,
+		"101 Capability list:\r\n"
+		"VERSION 2\r\n"
+		"IMPLEMENTATION nntpsink %s\r\n", PACKAGE_VERSION);
+	if (do_ihave)
+		client_send_lit(cl, "IHAVE\r\n");
+	if (do_streaming)
+		client_send_lit(cl, "STREAMING\r\n");
+	client_send_lit(cl, ".\r\n");
+}
 
-	if (cl->cl_flags & CL_DEAD)
+void
+cmd_quit(cl, data, len)
+	client_t	*cl;
+	char		*data;
+	size_t		 len;
+{
+	client_close(cl);
+}
+
+void
+cmd_mode(cl, data, len)
+	client_t	*cl;
+	char		*data;
+	size_t		 len;
+{
+	if (!data || strcasecmp(data, "STREAM"))
+		client_send_lit(cl, "501 Unknown MODE.\r\n");
+	else if (!do_streaming)
+		client_send_lit(cl, "501 Unknown MODE.\r\n");
+	else
+		client_send_lit(cl, "203 Streaming OK.\r\n");
+}
+
+void
+cmd_check(cl, data, len)
+	client_t	*cl;
+	char		*data;
+	size_t		 len;
+{
+	if (history && hist_check(history, hist_hash(data, len),
+				  ev_now(cl->cl_thread->th_loop))) {
+		thread_count(cl->cl_thread, tc_nrefuse, 1);
+		client_reply(cl, 438, data, len);
 		return;
+	}
 
-	if (cq_write(cl->cl_wrbuf, cl->cl_fd) < 0) {
-		if (ignore_errno(errno)) {
-			ev_io_start(loop, &cl->cl_writable);
-			return;
-		}
+	cl->cl_flags |= CL_CHECKED;
 
-		printf("[%d] write error: %s\n",
-			cl->cl_fd, strerror(errno));
-		client_close(cl);
+	switch (thread_policy(cl->cl_thread, data, len)) {
+	case PO_DEFER:
+		thread_count(cl->cl_thread, tc_ndefer, 1);
+		client_reply(cl, 431, data, len);
+		return;
+
+	case PO_REFUSE:
+		thread_count(cl->cl_thread, tc_nrefuse, 1);
+		client_reply(cl, 438, data, len);
 		return;
 	}
 
-	ev_io_stop(loop, &cl->cl_writable);
+	thread_count(cl->cl_thread, tc_nsend, 1);
+	client_reply(cl, 238, data, len);
 }
 
 void
-client_close(cl)
+cmd_takethis(cl, data, len)
 	client_t	*cl;
+	char		*data;
+	size_t		 len;
 {
-thread_t	*th = cl->cl_thread;
-struct ev_loop	*loop = th->th_loop;
+	client_article_start(cl, CL_TAKETHIS,
+			     thread_policy_takethis(cl->cl_thread, cl->cl_flags,
+						    data, len),
+			     data, len);
+}
 
-	if (cl->cl_flags & CL_DEAD)
+void
+cmd_ihave(cl, data, len)
+	client_t	*cl;
+	char		*data;
+	size_t		 len;
+{
+int	po;
+
+	if (history && hist_check(history, hist_hash(data, len),
+				  ev_now(cl->cl_thread->th_loop))) {
+		thread_count(cl->cl_thread, tc_nrefuse, 1);
+		client_reply(cl, 435, data, len);
 		return;
+	}
 
-	ev_io_stop(loop, &cl->cl_writable);
-	ev_io_stop(loop, &cl->cl_readable);
-	cl->cl_flags |= CL_DEAD;
+	switch (po = thread_policy(cl->cl_thread, data, len)) {
+	case PO_DEFER:
+		thread_count(cl->cl_thread, tc_ndefer, 1);
+		client_reply(cl, 436, data, len);
+		return;
 
-	cl->cl_next = th->th_deadlist;
-	th->th_deadlist = cl;
+	case PO_REFUSE:
+		thread_count(cl->cl_thread, tc_nrefuse, 1);
+		client_reply(cl, 435, data, len);
+		return;
+	}
+
+	client_reply(cl, 335, data, len);
+	client_article_start(cl, CL_IHAVE, po, data, len);
+	thread_count(cl->cl_thread, tc_nsend, 1);
 }
 
-void
-client_send(cl, s)
-	client_t	*cl;
-	char const	*s;
+#ifdef	USE_IO_URING
+int
+thread_uring_init(th)
+	thread_t	*th;
 {
-	cq_append(cl->cl_wrbuf, s, strlen(s));
-	if (cq_len(cl->cl_wrbuf) > 1024)
-		client_flush(cl);
+int	i;
+
+	if (ur_init(&th->th_ring, UR_ENTRIES) == -1)
+		return -1;
+
+	if (ur_bufs_init(&th->th_ring, &th->th_bufs, UR_NBUFS, 0) == -1)
+		return -1;
+
+	for (i = 0; i < UR_NBUFS; i++) {
+		th->th_bufents[i] = cq_pool_get(&th->th_pool);
+		ur_bufs_add(&th->th_bufs, th->th_bufents[i]->cqe_data,
+			    CHARQ_BSZ, i);
+	}
+
+	ev_io_init(&th->th_ring_ev, thread_uring_reap, th->th_ring.ur_evfd, EV_READ);
+	th->th_ring_ev.data = th;
+	return 0;
+}
+
+struct io_uring_sqe *
+thread_get_sqe(th)
+	thread_t	*th;
+{
+struct io_uring_sqe	*sqe;
+
+	if ((sqe = ur_get_sqe(&th->th_ring)) == NULL) {
+		fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+		_exit(1);
+	}
+
+	return sqe;
 }
 
 void
-client_vprintf(client_t *cl, char const *fmt, va_list ap)
+thread_uring_reap(loop, w, revents)
+	struct ev_loop	*loop;
+	ev_io		*w;
 {
-char	line[1024];
-int	n;
-	n = vsnprintf(line, sizeof(line), fmt, ap);
-	cq_append(cl->cl_wrbuf, line, n);
-	if (cq_len(cl->cl_wrbuf) > 1024)
-		client_flush(cl);
+thread_t		*th = w->data;
+struct io_uring_cqe	*cqe;
+uint64_t		 n, data;
+int			 res;
+unsigned		 flags;
+
+	/*
+	 * Clear the eventfd first; anything that completes after this will
+	 * signal it again.
+	 */
+	read(th->th_ring.ur_evfd, &n, sizeof(n));
+
+	while (cqe = ur_peek_cqe(&th->th_ring)) {
+		data = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		ur_cqe_seen(&th->th_ring);
+
+		switch (data & UR_OPMASK) {
+		case UR_RECV:
+			client_uring_recvd(ur_ptr(data), res, flags);
+			break;
+
+		case UR_SEND:
+			client_uring_sent(ur_ptr(data), res);
+			break;
+
+		case UR_ACCEPT:
+			listener_uring_accepted(ur_ptr(data), res, flags);
+			break;
+		}
+	}
 }
 
 void
-client_printf(client_t *cl, char const *fmt, ...)
+client_uring_recv(cl)
+	client_t	*cl;
 {
-va_list	ap;
-	va_start(ap, fmt);
-	client_vprintf(cl, fmt, ap);
-	va_end(ap);
+struct io_uring_sqe	*sqe = thread_get_sqe(cl->cl_thread);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = cl->cl_fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = cl->cl_thread->th_bufs.ub_bgid;
+	sqe->user_data = ur_data(cl, UR_RECV);
+	cl->cl_nops++;
 }
 
 void
-client_read(loop, w, revents)
-	struct ev_loop	*loop;
-	ev_io		*w;
+client_uring_recvd(cl, res, flags)
+	client_t	*cl;
+	unsigned	 flags;
 {
-client_t	*cl = w->data;
 thread_t	*th = cl->cl_thread;
-char		*ln;
-ssize_t		 n;
+charq_ent_t	*cqe;
+unsigned	 bid;
+
+	if (!(flags & IORING_CQE_F_MORE))
+		cl->cl_nops--;
+
+	/*
+	 * If the data can be linked straight onto the read buffer, do that and
+	 * give the kernel a new block; otherwise it's copied, and the kernel
+	 * gets the same block back.
+	 */
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		cqe = th->th_bufents[bid];
+		if (res > 0 && !(cl->cl_flags & CL_DEAD)
+		    && cq_append_ent(cl->cl_rdbuf, cqe, res))
+			th->th_bufents[bid] = cqe = cq_pool_get(&th->th_pool);
+		ur_bufs_add(&th->th_bufs, cqe->cqe_data, CHARQ_BSZ, bid);
+	}
 
-	if ((n = cq_read(cl->cl_rdbuf, cl->cl_fd)) == -1) {
-		if (ignore_errno(errno))
-			return;
-		printf("[%d] read error: %s\n",
-			cl->cl_fd, strerror(errno));
+	if (cl->cl_flags & CL_DEAD) {
+		client_uring_done(cl);
+		return;
+	}
+
+	if (res == 0) {
 		client_close(cl);
 		return;
 	}
 
-	if (n == 0) {
+	if (res < 0 && res != -ENOBUFS) {
+		printf("[%d] read error: %s\n", cl->cl_fd, strerror(-res));
 		client_close(cl);
 		return;
 	}
 
-	while (ln = cq_read_line(cl->cl_rdbuf)) {
-	char	*cmd, *data;
+	if (res > 0) {
+		thread_count(th, tc_nread, res);
+		cl->cl_nread += res;
+		client_process(cl);
+	}
 
-		if (debug)
-			printf("[%d] <- [%s]\n", cl->cl_fd, ln);
+	/* The kernel may end a multishot recv at any time; restart it. */
+	if (!(flags & IORING_CQE_F_MORE) && !(cl->cl_flags & CL_DEAD))
+		client_uring_recv(cl);
+}
 
-		/*
-		 * 238 <msg-id> -- CHECK, send the article
-		 * 431 <msg-id> -- CHECK, defer the article
-		 * 438 <msg-id> -- CHECK, never send the article
-		 * 239 <msg-id> -- TAKETHIS, accepted
-		 * 439 <msg-id> -- TAKETHIS, rejected
-		 * 335 <msg-id> -- IHAVE, send the article
-		 * 435 <msg-id> -- IHAVE, never send the article
-		 * 436 <msg-id> -- IHAVE, defer the article
-		 */
+void
+client_uring_send(cl)
+	client_t	*cl;
+{
+struct io_uring_sqe	*sqe;
 
-		if (cl->cl_state == CL_NORMAL) {
-			cmd = ln;
-			if ((data = index(cmd, ' ')) != NULL) {
-				*data++ = 0;
-				while (isspace(*data))
-					data++;
-				if (!*data)
-					data = NULL;
-			}
+	if (cl->cl_sending || cq_len(cl->cl_wrbuf) == 0
+	    || (cl->cl_flags & CL_DEAD))
+		return;
 
-			if (strcasecmp(cmd, "CAPABILITIES") == 0) {
-				client_printf(cl,
-					"101 Capability list:\r\n"
-					"VERSION 2\r\n"
-					"IMPLEMENTATION nntpsink %s\r\n", PACKAGE_VERSION);
-				if (do_ihave)
-					client_send(cl, "IHAVE\r\n");
-				if (do_streaming)
-					client_send(cl, "STREAMING\r\n");
-				client_send(cl, ".\r\n");
-			} else if (strcasecmp(cmd, "QUIT") == 0) {
-				client_close(cl);
-			} else if (strcasecmp(cmd, "MODE") == 0) {
-				if (!data || strcasecmp(data, "STREAM"))
-					client_send(cl, "501 Unknown MODE.\r\n");
-				else if (!do_streaming)
-					client_send(cl, "501 Unknown MODE.\r\n");
-				else
-					client_send(cl, "203 Streaming OK.\r\n");
-			} else if (strcasecmp(cmd, "CHECK") == 0) {
-				if (!do_streaming)
-					client_send(cl, "500 Unknown command.\r\n");
-				else if (!data)
-					client_send(cl, "501 Missing message-id.\r\n");
-				else {
-					th->th_nsend++;
-					client_printf(cl, "238 %s\r\n", data);
-				}
-			} else if (strcasecmp(cmd, "TAKETHIS") == 0) {
-				if (!do_streaming)
-					client_send(cl, "500 Unknown command.\r\n");
-				else if (!data)
-					client_send(cl, "501 Missing message-id.\r\n");
-				else {
-					cl->cl_msgid = strdup(data);
-					cl->cl_state = CL_TAKETHIS;
-				}
-			} else if (strcasecmp(cmd, "IHAVE") == 0) {
-				if (!do_ihave)
-					client_send(cl, "500 Unknown command.\r\n");
-				else if (!data)
-					client_send(cl, "501 Missing message-id.\r\n");
-				else {
-					client_printf(cl, "335 %s\r\n", data);
-					cl->cl_msgid = strdup(data);
-					cl->cl_state = CL_IHAVE;
-					th->th_nsend++;
-				}
-			} else {
-				client_send(cl, "500 Unknown command.\r\n");
-			}
-		} else if (cl->cl_state == CL_TAKETHIS || cl->cl_state == CL_IHAVE) {
-			if (strcmp(ln, ".") == 0) {
-				client_printf(cl, "%d %s\r\n",
-					cl->cl_state == CL_IHAVE ? 235 : 239,
-					cl->cl_msgid);
-				free(cl->cl_msgid);
-				cl->cl_msgid = NULL;
-				cl->cl_state = CL_NORMAL;
-				th->th_naccepted++;
-			}
-		}
+	bzero(&cl->cl_msg, sizeof(cl->cl_msg));
+	cl->cl_msg.msg_iov = cl->cl_iov;
+	cl->cl_msg.msg_iovlen = cq_iovec(cl->cl_wrbuf, cl->cl_iov, CHARQ_IOVMAX, NULL);
 
-		free(ln);
-		if (cl->cl_flags & CL_DEAD)
-			return;
+	sqe = thread_get_sqe(cl->cl_thread);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = cl->cl_fd;
+	sqe->addr = (unsigned long) &cl->cl_msg;
+	sqe->len = 1;
+	sqe->user_data = ur_data(cl, UR_SEND);
+
+	cl->cl_sending = 1;
+	cl->cl_nops++;
+	thread_count(cl->cl_thread, tc_nwrite, 1);
+}
+
+void
+client_uring_sent(cl, res)
+	client_t	*cl;
+{
+	cl->cl_nops--;
+	cl->cl_sending = 0;
+
+	if (cl->cl_flags & CL_DEAD) {
+		client_uring_done(cl);
+		return;
 	}
 
-	client_flush(cl);
+	if (res < 0 && res != -EAGAIN && res != -EINTR) {
+		printf("[%d] write error: %s\n", cl->cl_fd, strerror(-res));
+		client_close(cl);
+		return;
+	}
+
+	if (res > 0) {
+		cq_remove_start(cl->cl_wrbuf, res);
+		thread_count(cl->cl_thread, tc_nwritten, res);
+	}
+
+	/* Send whatever was added while this send was in flight. */
+	client_uring_send(cl);
+}
+
+/*
+ * Called when an operation on a dead client completes; once the last one has
+ * finished, the client can be freed.
+ */
+void
+client_uring_done(cl)
+	client_t	*cl;
+{
+	if ((cl->cl_flags & CL_ZOMBIE) && cl->cl_nops == 0)
+		client_destroy(cl);
+}
+
+void
+listener_uring_accept(lsn)
+	listener_t	*lsn;
+{
+struct io_uring_sqe	*sqe = thread_get_sqe(lsn->ln_thread);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = lsn->ln_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = ur_data(lsn, UR_ACCEPT);
+}
+
+void
+listener_uring_accepted(lsn, res, flags)
+	listener_t	*lsn;
+	unsigned	 flags;
+{
+	if (res >= 0)
+		client_new(lsn->ln_thread, res);
+	else if (!ignore_errno(-res))
+		fprintf(stderr, "accept: %s\n", strerror(-res));
+
+	if (!(flags & IORING_CQE_F_MORE))
+		listener_uring_accept(lsn);
+}
+#endif	/* USE_IO_URING */
+
+/*
+ * Periodically sync the history file, and empty expired slots before their
+ * times can wrap.  This has its own thread since both can take a while, and
+ * shouldn't hold up accepting connections.
+ */
+void *
+history_run(p)
+	void	*p;
+{
+unsigned	n;
+
+	for (n = 0;; n++) {
+		if (n % (HIST_SWEEP / HIST_SYNC_INTERVAL) == 0)
+			hist_expire(history, time(NULL));
+
+		sleep(HIST_SYNC_INTERVAL);
+		if (hist_sync(history) == -1)
+			fprintf(stderr, "%s: sync: %s\n", history_file,
+				strerror(errno));
+	}
+
+	return NULL;
 }
 
 void *
@@ -645,24 +3687,156 @@ void	*ret = calloc(n, sz);
 	return ret;
 }
 
+/*
+ * Add up every thread's counters.  Each thread's are read while it carries on
+ * updating them, so the total may be a little out of date, but whatever it
+ * misses is counted next time.
+ */
+void
+stats_collect(sum)
+	thread_counters_t	*sum;
+{
+thread_counters_t	*tc;
+int			 i;
+
+	bzero(sum, sizeof(*sum));
+	for (i = 0; i < nthreads; i++) {
+		tc = &threads[i].th_counters;
+		sum->tc_nsend += load_relaxed(&tc->tc_nsend);
+		sum->tc_naccepted += load_relaxed(&tc->tc_naccepted);
+		sum->tc_nrefuse += load_relaxed(&tc->tc_nrefuse);
+		sum->tc_ndefer += load_relaxed(&tc->tc_ndefer);
+		sum->tc_nreject += load_relaxed(&tc->tc_nreject);
+		sum->tc_nresp += load_relaxed(&tc->tc_nresp);
+		sum->tc_nwrite += load_relaxed(&tc->tc_nwrite);
+		sum->tc_nbudget += load_relaxed(&tc->tc_nbudget);
+		sum->tc_nshaped += load_relaxed(&tc->tc_nshaped);
+		sum->tc_nread += load_relaxed(&tc->tc_nread);
+		sum->tc_nwritten += load_relaxed(&tc->tc_nwritten);
+		sum->tc_pool_nget += load_relaxed(&tc->tc_pool_nget);
+		sum->tc_pool_nhit += load_relaxed(&tc->tc_pool_nhit);
+		hg_collect(&sum->tc_artbytes, &tc->tc_artbytes);
+		hg_collect(&sum->tc_artlines, &tc->tc_artlines);
+	}
+}
+
+void
+stats_sub(to, from)
+	thread_counters_t	*to;
+	thread_counters_t const	*from;
+{
+	to->tc_nsend -= from->tc_nsend;
+	to->tc_naccepted -= from->tc_naccepted;
+	to->tc_nrefuse -= from->tc_nrefuse;
+	to->tc_ndefer -= from->tc_ndefer;
+	to->tc_nreject -= from->tc_nreject;
+	to->tc_nresp -= from->tc_nresp;
+	to->tc_nwrite -= from->tc_nwrite;
+	to->tc_nbudget -= from->tc_nbudget;
+	to->tc_nshaped -= from->tc_nshaped;
+	to->tc_nread -= from->tc_nread;
+	to->tc_nwritten -= from->tc_nwritten;
+	to->tc_pool_nget -= from->tc_pool_nget;
+	to->tc_pool_nhit -= from->tc_pool_nhit;
+	hg_sub(&to->tc_artbytes, &from->tc_artbytes);
+	hg_sub(&to->tc_artlines, &from->tc_artlines);
+}
+
 void
 do_stats(loop, w, revents)
 	struct ev_loop	*loop;
 	ev_timer	*w;
 {
+static thread_counters_t last, now, d;
 struct rusage	rus;
 uint64_t	ct;
 time_t		upt = time(NULL) - start_time;
+size_t		poolsize = 0;
+int		i;
+
+	/* Report what's been counted since the last time. */
+	stats_collect(&now);
+	d = now;
+	stats_sub(&d, &last);
+	last = now;
 
-	pthread_mutex_lock(&stats_mtx);
 	getrusage(RUSAGE_SELF, &rus);
 	ct = (rus.ru_utime.tv_sec * 1000) + (rus.ru_utime.tv_usec / 1000)
 	   + (rus.ru_stime.tv_sec * 1000) + (rus.ru_stime.tv_usec / 1000);
 
-	printf("send it: %d/s, refused: %d/s, rejected: %d/s, deferred: %d/s, accepted: %d/s, cpu %.2f%%\n",
-		nsend, nrefuse, nreject, ndefer, naccept, (((double)ct / 1000) / upt) * 100);
-	nsend = nrefuse = nreject = ndefer = naccept = 0;
-	pthread_mutex_unlock(&stats_mtx);
+	for (i = 0; i < nthreads; i++)
+		poolsize += load_relaxed(&threads[i].th_poolsize);
+
+	printf("send it: %d/s, refused: %d/s, rejected: %d/s, deferred: %d/s, accepted: %d/s, cpu %.2f%%, "
+	       "pool: %.1f%% hit, %lu KB, writes/response: %.2f, over budget: %d/s\n",
+		(int) d.tc_nsend, (int) d.tc_nrefuse, (int) d.tc_nreject,
+		(int) d.tc_ndefer, (int) d.tc_naccepted,
+		(((double)ct / 1000) / upt) * 100,
+		d.tc_pool_nget ? ((double) d.tc_pool_nhit / d.tc_pool_nget) * 100 : 100.,
+		(unsigned long) (poolsize / 1024),
+		d.tc_nresp ? (double) d.tc_nwrite / d.tc_nresp : 0.,
+		(int) d.tc_nbudget);
+
+	printf("traffic: in %.2f MB/s, out %.2f MB/s, article bytes p50/p90/p99/max: "
+	       "%lu/%lu/%lu/%lu, lines: %lu/%lu/%lu/%lu\n",
+		(double) d.tc_nread / 1024 / 1024,
+		(double) d.tc_nwritten / 1024 / 1024,
+		(unsigned long) hg_percentile(&d.tc_artbytes, 50),
+		(unsigned long) hg_percentile(&d.tc_artbytes, 90),
+		(unsigned long) hg_percentile(&d.tc_artbytes, 99),
+		(unsigned long) d.tc_artbytes.hg_max,
+		(unsigned long) hg_percentile(&d.tc_artlines, 50),
+		(unsigned long) hg_percentile(&d.tc_artlines, 90),
+		(unsigned long) hg_percentile(&d.tc_artlines, 99),
+		(unsigned long) d.tc_artlines.hg_max);
+
+	/* Shaped rates are the limits, in KB/s; 0 is none. */
+	if (do_shape) {
+	static uint64_t	*lastlsn;
+	uint64_t	 lsnmax = 0, n;
+	int		 nconns = 0;
+
+		for (i = 0; i < nthreads; i++)
+			nconns += load_relaxed(&threads[i].th_nclients);
+
+		if (lastlsn == NULL && nlsn_buckets)
+			lastlsn = xcalloc(nlsn_buckets, sizeof(*lastlsn));
+		for (i = 0; i < nlsn_buckets; i++) {
+			n = load_relaxed(&lsn_buckets[i].lb_nread);
+			if (n - lastlsn[i] > lsnmax)
+				lsnmax = n - lastlsn[i];
+			lastlsn[i] = n;
+		}
+
+		printf("shaping: conn %.1f/%lu KB/s, listener %.1f/%lu KB/s, global %.1f/%lu KB/s, "
+		       "connections: %d, throttled: %d/s\n",
+			nconns ? (double) d.tc_nread / nconns / 1024 : 0.,
+			(unsigned long) (shape_conn / 1024),
+			(double) lsnmax / 1024,
+			(unsigned long) (shape_listener / 1024),
+			(double) d.tc_nread / 1024,
+			(unsigned long) (shape_global.bk_rate / 1024),
+			nconns, (int) d.tc_nshaped);
+	}
+
+	if (spool) {
+	static uint64_t	lastwritten, lastarts, lastdropped, lastsync;
+	uint64_t	nwritten = load_relaxed(&spool->sp_nwritten),
+			narts = load_relaxed(&spool->sp_narts),
+			ndropped = load_relaxed(&spool->sp_ndropped),
+			nsync = load_relaxed(&spool->sp_nsync);
+
+		printf("spool: %.2f MB/s, %d articles/s, %d syncs/s, queue: %lu (%lu KB), dropped: %d/s\n",
+			(double) (nwritten - lastwritten) / 1024 / 1024,
+			(int) (narts - lastarts), (int) (nsync - lastsync),
+			(unsigned long) load_relaxed(&spool->sp_qlen),
+			(unsigned long) (load_relaxed(&spool->sp_qbytes) / 1024),
+			(int) (ndropped - lastdropped));
+		lastwritten = nwritten;
+		lastarts = narts;
+		lastdropped = ndropped;
+		lastsync = nsync;
+	}
 }
 
 void
@@ -676,6 +3850,14 @@ thread_t	*th = w->data;
 	cl = th->th_deadlist;
 	while (cl) {
 		next = cl->cl_next;
+#ifdef	USE_IO_URING
+		if (cl->cl_nops) {
+			/* client_uring_done() will destroy it. */
+			cl->cl_flags |= CL_ZOMBIE;
+			cl = next;
+			continue;
+		}
+#endif
 		client_destroy(cl);
 		cl = next;
 	}
@@ -688,15 +3870,34 @@ do_thread_stats(loop, w, revents)
 	ev_timer	*w;
 {
 thread_t	*th = w->data;
-
-	pthread_mutex_lock(&stats_mtx);
-	nsend += th->th_nsend;
-	naccept += th->th_naccepted;
-	ndefer += th->th_ndefer;
-	nreject += th->th_nreject;
-	nrefuse += th->th_nrefuse;
-	pthread_mutex_unlock(&stats_mtx);
-
-	th->th_nsend = th->th_naccepted = th->th_ndefer = th->th_nreject
-		= th->th_nrefuse = 0;
+uint64_t	 nread = th->th_counters.tc_nread;
+
+	/*
+	 * The pool and the histograms are updated too often to write through
+	 * to th_counters, so they're published once a tick instead.
+	 */
+	thread_count(th, tc_pool_nget, th->th_pool.cqp_nget);
+	thread_count(th, tc_pool_nhit, th->th_pool.cqp_nhit);
+	th->th_pool.cqp_nget = th->th_pool.cqp_nhit = 0;
+	store_relaxed(&th->th_poolsize, cq_pool_size(&th->th_pool));
+
+	hg_publish(&th->th_counters.tc_artbytes, &th->th_artbytes);
+	hg_publish(&th->th_counters.tc_artlines, &th->th_artlines);
+	hg_reset(&th->th_artbytes);
+	hg_reset(&th->th_artlines);
+
+	/* Smooth the read rate over the last few ticks. */
+	store_relaxed(&th->th_rate,
+		      th->th_rate * 7 / 10 + (nread - th->th_lastread) * 3);
+	th->th_lastread = nread;
+
+	/*
+	 * Once a second, give back buffer blocks we haven't needed, and see
+	 * if another thread should take some of our clients.
+	 */
+	if (++th->th_nticks % 10 == 0) {
+		cq_pool_trim(&th->th_pool);
+		if (do_migrate)
+			thread_rebalance(th);
+	}
 }
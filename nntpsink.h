@@ -18,4 +18,22 @@
 void	*xcalloc(size_t, size_t);
 void	*xmalloc(size_t);
 
+/* For data shared between threads without a lock. */
+#define	load_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define	store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* For counters other threads only look at, where ordering doesn't matter. */
+#define	load_relaxed(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define	store_relaxed(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+/* Add to a counter that only the calling thread ever writes. */
+#define	counter_add(p, n)	store_relaxed((p), *(p) + (n))
+
+/*
+ * Data written by different threads should be on different cache lines, or
+ * every write by one thread makes the others miss.
+ */
+#define	CACHE_LINE	64
+#define	cache_aligned	__attribute__((aligned(CACHE_LINE)))
+
 #endif	/* !NNTPSINK_H_INCLUDED */
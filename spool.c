@@ -0,0 +1,433 @@
+/* nntpsink: dummy NNTP server */
+/*
+ * Copyright (c) 2013-2014 Felicity Tarnell.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#include	<sys/types.h>
+#include	<sys/stat.h>
+#include	<sys/uio.h>
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<unistd.h>
+#include	<fcntl.h>
+#include	<errno.h>
+#include	<time.h>
+
+#include	"spool.h"
+#include	"nntpsink.h"
+
+static void	*spool_run(void *);
+static void	 spool_write(spool_t *, spool_art_t *);
+static int	 spool_flush(spool_t *, struct iovec *, int, off_t);
+static void	 spool_unstuff(spool_art_t *);
+static void	 spool_art_drop(spool_art_t *);
+
+static char const spool_zero[SPOOL_ALIGN];
+
+#define	spool_reclen(a)	\
+	((sizeof(struct spool_rec) + (a)->sa_len + SPOOL_ALIGN - 1) & ~(uint64_t) (SPOOL_ALIGN - 1))
+
+/*
+ * Open the spool at path, creating it with size bytes if it doesn't exist and
+ * size isn't 0.  An existing spool keeps its size, and writing carries on
+ * where it left off.
+ */
+spool_t *
+spool_open(path, size)
+	char const	*path;
+	uint64_t	 size;
+{
+spool_t			*sp = xcalloc(1, sizeof(*sp));
+struct spool_header	*hdr = &sp->sp_hdr;
+struct stat		 sb;
+int			 save;
+
+	if ((sp->sp_fd = open(path, O_RDWR | O_CLOEXEC | (size ? O_CREAT : 0),
+			      0644)) == -1)
+		goto err;
+
+	if (fstat(sp->sp_fd, &sb) == -1)
+		goto err;
+
+	if (sb.st_size == 0) {
+		size &= ~(uint64_t) (SPOOL_ALIGN - 1);
+		if (size < SPOOL_HDRSZ + SPOOL_ALIGN) {
+			errno = EINVAL;
+			goto err;
+		}
+
+		bcopy(SPOOL_MAGIC, hdr->sh_magic, sizeof(hdr->sh_magic));
+		hdr->sh_size = size;
+		hdr->sh_offset = SPOOL_HDRSZ;
+
+#ifdef	HAVE_POSIX_FALLOCATE
+		if ((errno = posix_fallocate(sp->sp_fd, 0, size)) != 0)
+			goto err;
+#else
+		if (ftruncate(sp->sp_fd, size) == -1)
+			goto err;
+#endif
+		if (pwrite(sp->sp_fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+			goto err;
+	} else {
+		if (pread(sp->sp_fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)
+		    || memcmp(hdr->sh_magic, SPOOL_MAGIC, sizeof(hdr->sh_magic))
+		    || hdr->sh_size != (uint64_t) sb.st_size
+		    || hdr->sh_offset < SPOOL_HDRSZ
+		    || hdr->sh_offset > hdr->sh_size
+		    || (hdr->sh_offset & (SPOOL_ALIGN - 1))) {
+			errno = EINVAL;
+			goto err;
+		}
+	}
+
+	if (sem_init(&sp->sp_sem, 0, 0) == -1)
+		goto err;
+
+	return sp;
+
+err:
+	save = errno;
+	if (sp->sp_fd != -1)
+		close(sp->sp_fd);
+	free(sp);
+	errno = save;
+	return NULL;
+}
+
+int
+spool_start(sp)
+	spool_t	*sp;
+{
+	if ((errno = pthread_create(&sp->sp_thread, NULL, spool_run, sp)) != 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Queue an article for writing; the spool owns it from now on.  This is
+ * called from worker threads, so it only pushes the article onto sp_queue
+ * (like client migration, a lock-free stack) and wakes the writer if it
+ * might be waiting.
+ */
+void
+spool_submit(sp, a, termlen)
+	spool_t		*sp;
+	spool_art_t	*a;
+	int		 termlen;
+{
+spool_art_t	*head;
+
+	if (a->sa_data == NULL
+	    || load_relaxed(&sp->sp_qbytes) + a->sa_len > SPOOL_MAXQUEUE) {
+		__atomic_fetch_add(&sp->sp_ndropped, 1, __ATOMIC_RELAXED);
+		spool_art_free(a);
+		return;
+	}
+
+	a->sa_len -= termlen;
+	__atomic_fetch_add(&sp->sp_qlen, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&sp->sp_qbytes, a->sa_len, __ATOMIC_RELAXED);
+
+	head = load_relaxed(&sp->sp_queue);
+	do {
+		a->sa_next = head;
+	} while (!__atomic_compare_exchange_n(&sp->sp_queue, &head, a, 1,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if (head == NULL)
+		sem_post(&sp->sp_sem);
+}
+
+static void *
+spool_run(arg)
+	void	*arg;
+{
+spool_t		*sp = arg;
+spool_art_t	*list, *a, *next;
+
+	for (;;) {
+		if (sem_wait(&sp->sp_sem) == -1)
+			continue;
+
+		list = __atomic_exchange_n(&sp->sp_queue, NULL, __ATOMIC_ACQUIRE);
+		if (list == NULL)
+			continue;
+
+		/* Put the batch back in the order it was submitted. */
+		for (a = list, list = NULL; a; a = next) {
+			next = a->sa_next;
+			a->sa_next = list;
+			list = a;
+		}
+
+		spool_write(sp, list);
+	}
+
+	return NULL;
+}
+
+/*
+ * Write a batch of articles, then sync it and update the header.  Records go
+ * to the file in order, so the batch is one pwritev() per SPOOL_IOVMAX/3
+ * records, plus one more each time writing wraps.  If a write fails, the
+ * articles from there on are dropped; if the sync fails, the whole batch is,
+ * and the header stays where it was.
+ */
+static void
+spool_write(sp, list)
+	spool_t		*sp;
+	spool_art_t	*list;
+{
+struct spool_header	*hdr = &sp->sp_hdr;
+struct iovec		 iov[SPOOL_IOVMAX];
+spool_art_t		*a, *next;
+off_t			 start = hdr->sh_offset;
+uint64_t		 offset0 = hdr->sh_offset, cycle0 = hdr->sh_cycle;
+uint64_t		 goodoffset = offset0, goodcycle = cycle0;
+uint64_t		 reclen, nbytes = 0, narts = 0, bbytes = 0, barts = 0;
+size_t			 qbytes = 0, qlen = 0;
+int			 niov = 0;
+time_t			 now = time(NULL);
+
+	for (a = list; a; a = a->sa_next) {
+		qlen++;
+		qbytes += a->sa_len;
+	}
+
+	for (a = list; a; a = a->sa_next) {
+		spool_unstuff(a);
+		reclen = spool_reclen(a);
+		if (reclen > hdr->sh_size - SPOOL_HDRSZ)
+			continue;
+
+		if (niov + 3 > SPOOL_IOVMAX
+		    || hdr->sh_offset + reclen > hdr->sh_size) {
+			if (spool_flush(sp, iov, niov, start) == -1)
+				goto failed;
+			niov = 0;
+			nbytes += bbytes;
+			narts += barts;
+			bbytes = barts = 0;
+			goodoffset = hdr->sh_offset;
+			goodcycle = hdr->sh_cycle;
+
+			if (hdr->sh_offset + reclen > hdr->sh_size) {
+				hdr->sh_offset = SPOOL_HDRSZ;
+				hdr->sh_cycle++;
+			}
+			start = hdr->sh_offset;
+		}
+
+		a->sa_rec.sr_magic = SPOOL_RECMAGIC;
+		a->sa_rec.sr_cycle = hdr->sh_cycle;
+		a->sa_rec.sr_time = now;
+
+		iov[niov].iov_base = &a->sa_rec;
+		iov[niov++].iov_len = sizeof(a->sa_rec);
+		iov[niov].iov_base = a->sa_data;
+		iov[niov++].iov_len = a->sa_len;
+		iov[niov].iov_base = (void *) spool_zero;
+		iov[niov++].iov_len = reclen - sizeof(a->sa_rec) - a->sa_len;
+
+		hdr->sh_offset += reclen;
+		bbytes += reclen;
+		barts++;
+	}
+
+	if (spool_flush(sp, iov, niov, start) == 0) {
+		nbytes += bbytes;
+		narts += barts;
+		goodoffset = hdr->sh_offset;
+		goodcycle = hdr->sh_cycle;
+	}
+
+failed:
+	/* Only keep what was written. */
+	hdr->sh_offset = goodoffset;
+	hdr->sh_cycle = goodcycle;
+
+	if (narts == 0)
+		goto done;
+
+#ifdef	HAVE_FDATASYNC
+	if (fdatasync(sp->sp_fd) == -1) {
+#else
+	if (fsync(sp->sp_fd) == -1) {
+#endif
+		fprintf(stderr, "spool: sync: %s\n", strerror(errno));
+		hdr->sh_offset = offset0;
+		hdr->sh_cycle = cycle0;
+		nbytes = narts = 0;
+		goto done;
+	}
+
+	/*
+	 * The header only ever points at data that's already been synced; it
+	 * reaches the disk with the next batch.
+	 */
+	if (pwrite(sp->sp_fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+		fprintf(stderr, "spool: header: %s\n", strerror(errno));
+
+	__atomic_fetch_add(&sp->sp_nsync, 1, __ATOMIC_RELAXED);
+
+done:
+	for (a = list; a; a = next) {
+		next = a->sa_next;
+		spool_art_free(a);
+	}
+
+	__atomic_fetch_add(&sp->sp_nwritten, nbytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&sp->sp_narts, narts, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&sp->sp_ndropped, qlen - narts, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&sp->sp_qlen, qlen, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&sp->sp_qbytes, qbytes, __ATOMIC_RELAXED);
+}
+
+static int
+spool_flush(sp, iov, niov, offs)
+	spool_t		*sp;
+	struct iovec	*iov;
+	int		 niov;
+	off_t		 offs;
+{
+ssize_t	n;
+size_t	len = 0;
+int	i;
+
+	if (niov == 0)
+		return 0;
+
+	for (i = 0; i < niov; i++)
+		len += iov[i].iov_len;
+
+	if ((n = pwritev(sp->sp_fd, iov, niov, offs)) != (ssize_t) len) {
+		fprintf(stderr, "spool: write: %s\n",
+			n == -1 ? strerror(errno) : "short write");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Remove the extra "." from lines that start with one, in place.
+ */
+static void
+spool_unstuff(a)
+	spool_art_t	*a;
+{
+char	*p = a->sa_data + a->sa_rec.sr_msgidlen, *end = a->sa_data + a->sa_len;
+char	*out = p, *q;
+size_t	 n;
+
+	while (p < end) {
+		if (*p == '.')
+			p++;
+
+		if ((q = memchr(p, '\n', end - p)) == NULL)
+			q = end;
+		else
+			q++;
+
+		n = q - p;
+		if (out != p)
+			memmove(out, p, n);
+		out += n;
+		p = q;
+	}
+
+	a->sa_len = out - a->sa_data;
+	a->sa_rec.sr_len = a->sa_len - a->sa_rec.sr_msgidlen;
+}
+
+spool_art_t *
+spool_art_new(sp, msgid, len)
+	spool_t		*sp;
+	char const	*msgid;
+	size_t		 len;
+{
+spool_art_t	*a = xcalloc(1, sizeof(*a));
+
+	a->sa_spool = sp;
+	a->sa_size = SPOOL_ARTSZ;
+	while (a->sa_size < len)
+		a->sa_size *= 2;
+	if (sp->sp_inuse)
+		__atomic_add_fetch(sp->sp_inuse, a->sa_size, __ATOMIC_RELAXED);
+	a->sa_data = xmalloc(a->sa_size);
+	bcopy(msgid, a->sa_data, len);
+	a->sa_len = len;
+	a->sa_rec.sr_msgidlen = len;
+	return a;
+}
+
+void
+spool_art_free(a)
+	spool_art_t	*a;
+{
+	if (a == NULL)
+		return;
+	spool_art_drop(a);
+	free(a);
+}
+
+/* Give up on spooling this article, and free its data. */
+static void
+spool_art_drop(a)
+	spool_art_t	*a;
+{
+	if (a->sa_data == NULL)
+		return;
+	if (a->sa_spool->sp_inuse)
+		__atomic_sub_fetch(a->sa_spool->sp_inuse, a->sa_size, __ATOMIC_RELAXED);
+	free(a->sa_data);
+	a->sa_data = NULL;
+	a->sa_size = 0;
+}
+
+void
+spool_art_save(udata, buf, len)
+	void		*udata;
+	char const	*buf;
+	size_t		 len;
+{
+spool_art_t	*a = udata;
+spool_t		*sp = a->sa_spool;
+size_t		 size;
+
+	if (a->sa_data == NULL)
+		return;
+
+	if (a->sa_len + len > a->sa_size) {
+		for (size = a->sa_size; a->sa_len + len > size; size *= 2)
+			;
+
+		if (size > SPOOL_MAXART
+		    || (sp->sp_inuse && load_relaxed(sp->sp_inuse) + (size - a->sa_size)
+			> sp->sp_memcap)) {
+			spool_art_drop(a);
+			return;
+		}
+
+		if (sp->sp_inuse)
+			__atomic_add_fetch(sp->sp_inuse, size - a->sa_size,
+					   __ATOMIC_RELAXED);
+		a->sa_size = size;
+		if ((a->sa_data = realloc(a->sa_data, a->sa_size)) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			abort();
+		}
+	}
+
+	bcopy(buf, a->sa_data + a->sa_len, len);
+	a->sa_len += len;
+}
@@ -0,0 +1,107 @@
+/* nntpsink: dummy NNTP server */
+/*
+ * Copyright (c) 2013-2014 Felicity Tarnell.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#ifndef	NNTPSINK_SPOOL_H
+#define	NNTPSINK_SPOOL_H
+
+#include	<sys/types.h>
+
+#include	<stdint.h>
+#include	<pthread.h>
+#include	<semaphore.h>
+
+/*
+ * Article spool: a cyclic buffer file in the style of INN's CNFS.  The file is
+ * allocated up front and never grows; after a header page, records are laid
+ * end to end, and when the next one won't fit before the end of the file,
+ * writing starts again at the beginning, overwriting the oldest articles.
+ * Each record is a spool_rec, the message-ID, then the dot-unstuffed article
+ * without its terminating "." line, padded to SPOOL_ALIGN bytes.
+ *
+ * Worker threads collect each article in a spool_art_t as it's read, and pass
+ * it to spool_submit(), which never blocks; if too much is already queued, the
+ * article is dropped instead.  An article is also dropped as it's read if it
+ * grows past SPOOL_MAXART, or if sp_inuse is set and growing it would take
+ * that over sp_memcap; the memory for each article is counted in sp_inuse
+ * until it's written.  A single writer thread takes everything that's
+ * queued, writes it with as few pwritev() calls as it can, then makes the
+ * whole batch durable with one fdatasync() before recording the new write
+ * position in the header.
+ */
+
+#define	SPOOL_MAGIC	"NSSPOOL1"
+#define	SPOOL_HDRSZ	4096
+#define	SPOOL_ALIGN	512
+#define	SPOOL_IOVMAX	192		/* Three iovecs per record */
+#define	SPOOL_MAXQUEUE	(256 * 1024 * 1024)
+#define	SPOOL_ARTSZ	16384		/* Initial article buffer */
+#define	SPOOL_MAXART	(32 * 1024 * 1024)
+
+struct spool_header {
+	char		sh_magic[8];
+	uint64_t	sh_size;	/* Size of the file */
+	uint64_t	sh_offset;	/* Where the next record goes */
+	uint64_t	sh_cycle;	/* Times writing has wrapped */
+};
+
+#define	SPOOL_RECMAGIC	0x4e535231	/* "NSR1" */
+
+struct spool_rec {
+	uint32_t	sr_magic;
+	uint32_t	sr_msgidlen;
+	uint64_t	sr_len;		/* Article length */
+	uint64_t	sr_cycle;	/* sh_cycle when it was written */
+	uint64_t	sr_time;
+};
+
+typedef struct spool_art {
+	struct spool_art *sa_next;
+	struct spool	 *sa_spool;
+	struct spool_rec  sa_rec;
+	char		 *sa_data;	/* Message-ID, then the article; NULL if dropped */
+	size_t		  sa_len;
+	size_t		  sa_size;
+} spool_art_t;
+
+typedef struct spool {
+	int			 sp_fd;
+	struct spool_header	 sp_hdr;	/* Only used by the writer */
+	spool_art_t		*sp_queue;	/* Submitted, newest first */
+	sem_t			 sp_sem;	/* Posted when sp_queue was empty */
+	pthread_t		 sp_thread;
+
+	size_t			*sp_inuse;	/* If set, bytes in use, shared */
+	size_t			 sp_memcap;	/* ... which articles mustn't take past this */
+
+	/* Statistics; read these with load_relaxed(). */
+	size_t			 sp_qlen;	/* Articles queued */
+	size_t			 sp_qbytes;
+	uint64_t		 sp_nwritten;	/* Bytes written */
+	uint64_t		 sp_narts;	/* Articles written */
+	uint64_t		 sp_ndropped;	/* Articles not written */
+	uint64_t		 sp_nsync;
+} spool_t;
+
+spool_t		*spool_open(char const *path, uint64_t size);
+int		 spool_start(spool_t *);
+
+/*
+ * The article must end with its terminating "." line, whose length (with the
+ * line ending) is termlen.
+ */
+void		 spool_submit(spool_t *, spool_art_t *, int termlen);
+
+spool_art_t	*spool_art_new(spool_t *, char const *msgid, size_t len);
+void		 spool_art_free(spool_art_t *);
+
+/* A cqb_save callback: append data to the spool_art_t udata. */
+void		 spool_art_save(void *udata, char const *, size_t);
+
+#endif	/* !NNTPSINK_SPOOL_H */
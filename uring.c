@@ -0,0 +1,213 @@
+/* nntpsink: dummy NNTP server */
+/*
+ * Copyright (c) 2013-2014 Felicity Tarnell.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#include	<sys/types.h>
+#include	<sys/mman.h>
+#include	<sys/syscall.h>
+#include	<sys/eventfd.h>
+
+#include	<stdlib.h>
+#include	<strings.h>
+#include	<unistd.h>
+#include	<errno.h>
+
+#include	"uring.h"
+#include	"nntpsink.h"
+
+int
+ur_init(ur, entries)
+	uring_t		*ur;
+	unsigned	 entries;
+{
+struct io_uring_params	p;
+unsigned		i, *sqarray;
+int			save;
+
+	bzero(ur, sizeof(*ur));
+	bzero(&p, sizeof(p));
+
+	if ((ur->ur_fd = syscall(__NR_io_uring_setup, entries, &p)) == -1)
+		return -1;
+
+	ur->ur_sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->ur_cqringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->ur_cqringsz > ur->ur_sqringsz)
+			ur->ur_sqringsz = ur->ur_cqringsz;
+		ur->ur_cqringsz = ur->ur_sqringsz;
+	}
+
+	ur->ur_sqring = mmap(NULL, ur->ur_sqringsz, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQ_RING);
+	if (ur->ur_sqring == MAP_FAILED)
+		goto err;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ur->ur_cqring = ur->ur_sqring;
+	else {
+		ur->ur_cqring = mmap(NULL, ur->ur_cqringsz, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ur->ur_fd,
+				     IORING_OFF_CQ_RING);
+		if (ur->ur_cqring == MAP_FAILED)
+			goto err_sqring;
+	}
+
+	ur->ur_sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->ur_sqes = mmap(NULL, ur->ur_sqesz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQES);
+	if (ur->ur_sqes == MAP_FAILED)
+		goto err_cqring;
+
+	ur->ur_sqhead = (unsigned *) ((char *) ur->ur_sqring + p.sq_off.head);
+	ur->ur_sqtail = (unsigned *) ((char *) ur->ur_sqring + p.sq_off.tail);
+	ur->ur_sqmask = *(unsigned *) ((char *) ur->ur_sqring + p.sq_off.ring_mask);
+	ur->ur_sqentries = p.sq_entries;
+	ur->ur_sqlocal = *ur->ur_sqtail;
+
+	/*
+	 * We always fill SQEs in ring order, so the index array never needs to
+	 * change.
+	 */
+	sqarray = (unsigned *) ((char *) ur->ur_sqring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		sqarray[i] = i;
+
+	ur->ur_cqhead = (unsigned *) ((char *) ur->ur_cqring + p.cq_off.head);
+	ur->ur_cqtail = (unsigned *) ((char *) ur->ur_cqring + p.cq_off.tail);
+	ur->ur_cqmask = *(unsigned *) ((char *) ur->ur_cqring + p.cq_off.ring_mask);
+	ur->ur_cqes = (struct io_uring_cqe *) ((char *) ur->ur_cqring + p.cq_off.cqes);
+
+	if ((ur->ur_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		goto err_sqes;
+
+	if (syscall(__NR_io_uring_register, ur->ur_fd, IORING_REGISTER_EVENTFD,
+		    &ur->ur_evfd, 1) == -1)
+		goto err_evfd;
+
+	return 0;
+
+	/* Undo whatever was done, in reverse order. */
+err_evfd:
+	save = errno;
+	close(ur->ur_evfd);
+	errno = save;
+err_sqes:
+	munmap(ur->ur_sqes, ur->ur_sqesz);
+err_cqring:
+	if (ur->ur_cqring != ur->ur_sqring)
+		munmap(ur->ur_cqring, ur->ur_cqringsz);
+err_sqring:
+	munmap(ur->ur_sqring, ur->ur_sqringsz);
+err:
+	save = errno;
+	close(ur->ur_fd);
+	errno = save;
+	return -1;
+}
+
+/*
+ * Return a zeroed SQE for the caller to fill in.  If the submission queue is
+ * full, submit what's already there to make room.
+ */
+struct io_uring_sqe *
+ur_get_sqe(ur)
+	uring_t	*ur;
+{
+struct io_uring_sqe	*sqe;
+
+	while (ur->ur_sqlocal - load_acquire(ur->ur_sqhead) >= ur->ur_sqentries)
+		if (ur_submit(ur) == -1 && errno != EAGAIN && errno != EBUSY
+		    && errno != EINTR)
+			return NULL;
+
+	sqe = &ur->ur_sqes[ur->ur_sqlocal & ur->ur_sqmask];
+	bzero(sqe, sizeof(*sqe));
+	ur->ur_sqlocal++;
+	return sqe;
+}
+
+int
+ur_submit(ur)
+	uring_t	*ur;
+{
+unsigned	n;
+
+	store_release(ur->ur_sqtail, ur->ur_sqlocal);
+	if ((n = ur->ur_sqlocal - load_acquire(ur->ur_sqhead)) == 0)
+		return 0;
+
+	return syscall(__NR_io_uring_enter, ur->ur_fd, n, 0, 0, NULL, 0);
+}
+
+struct io_uring_cqe *
+ur_peek_cqe(ur)
+	uring_t	*ur;
+{
+unsigned	head = *ur->ur_cqhead;
+
+	if (head == load_acquire(ur->ur_cqtail))
+		return NULL;
+	return &ur->ur_cqes[head & ur->ur_cqmask];
+}
+
+void
+ur_cqe_seen(ur)
+	uring_t	*ur;
+{
+	store_release(ur->ur_cqhead, *ur->ur_cqhead + 1);
+}
+
+int
+ur_bufs_init(ur, ub, entries, bgid)
+	uring_t		*ur;
+	uring_bufs_t	*ub;
+	unsigned	 entries, bgid;
+{
+struct io_uring_buf_reg	reg;
+
+	bzero(ub, sizeof(*ub));
+	ub->ub_entries = entries;
+	ub->ub_bgid = bgid;
+	ub->ub_ringsz = entries * sizeof(struct io_uring_buf);
+	ub->ub_ring = mmap(NULL, ub->ub_ringsz, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ub->ub_ring == MAP_FAILED)
+		return -1;
+
+	bzero(&reg, sizeof(reg));
+	reg.ring_addr = (unsigned long) ub->ub_ring;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+
+	if (syscall(__NR_io_uring_register, ur->ur_fd, IORING_REGISTER_PBUF_RING,
+		    &reg, 1) == -1) {
+	int	save = errno;
+		munmap(ub->ub_ring, ub->ub_ringsz);
+		errno = save;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+ur_bufs_add(ub, buf, len, bid)
+	uring_bufs_t	*ub;
+	void		*buf;
+	unsigned	 len, bid;
+{
+struct io_uring_buf	*b;
+
+	b = &ub->ub_ring->bufs[ub->ub_tail & (ub->ub_entries - 1)];
+	b->addr = (unsigned long) buf;
+	b->len = len;
+	b->bid = bid;
+	store_release(&ub->ub_ring->tail, ++ub->ub_tail);
+}
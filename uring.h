@@ -0,0 +1,77 @@
+/* nntpsink: dummy NNTP server */
+/*
+ * Copyright (c) 2013-2014 Felicity Tarnell.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#ifndef	NNTPSINK_URING_H
+#define	NNTPSINK_URING_H
+
+#include	<sys/types.h>
+
+#include	<linux/io_uring.h>
+
+/*
+ * A minimal io_uring interface, talking to the kernel directly rather than
+ * through liburing.  SQEs obtained from ur_get_sqe() are only passed to the
+ * kernel by ur_submit(), so a caller can queue up any number of operations and
+ * submit them with a single system call.  When an operation completes, the
+ * kernel signals ur_evfd; the caller should then reap completions with
+ * ur_peek_cqe() and ur_cqe_seen().
+ *
+ * A uring is not locked, and must only be used by one thread at a time.
+ */
+
+typedef struct uring {
+	int			 ur_fd;
+	int			 ur_evfd;	/* Signalled on completion */
+
+	unsigned		*ur_sqhead;
+	unsigned		*ur_sqtail;
+	unsigned		 ur_sqmask;
+	unsigned		 ur_sqentries;
+	unsigned		 ur_sqlocal;	/* Our tail, not yet published */
+	struct io_uring_sqe	*ur_sqes;
+
+	unsigned		*ur_cqhead;
+	unsigned		*ur_cqtail;
+	unsigned		 ur_cqmask;
+	struct io_uring_cqe	*ur_cqes;
+
+	void			*ur_sqring;
+	void			*ur_cqring;
+	size_t			 ur_sqringsz;
+	size_t			 ur_cqringsz;
+	size_t			 ur_sqesz;
+} uring_t;
+
+int			 ur_init(uring_t *, unsigned entries);
+struct io_uring_sqe	*ur_get_sqe(uring_t *);
+int			 ur_submit(uring_t *);
+struct io_uring_cqe	*ur_peek_cqe(uring_t *);
+void			 ur_cqe_seen(uring_t *);
+
+/*
+ * A provided buffer ring: a set of buffers the kernel picks from when a read
+ * with IOSQE_BUFFER_SELECT completes.  The buffer used is identified by the
+ * bid in the CQE flags; once the caller is done with it, it (or a
+ * replacement) is given back with ur_bufs_add().
+ */
+typedef struct uring_bufs {
+	struct io_uring_buf_ring	*ub_ring;
+	size_t				 ub_ringsz;
+	unsigned			 ub_entries;
+	unsigned short			 ub_bgid;
+	unsigned short			 ub_tail;
+} uring_bufs_t;
+
+int	ur_bufs_init(uring_t *, uring_bufs_t *, unsigned entries, unsigned bgid);
+void	ur_bufs_add(uring_bufs_t *, void *, unsigned len, unsigned bid);
+
+#define	ur_cqe_bid(cqe)	((cqe)->flags >> IORING_CQE_BUFFER_SHIFT)
+
+#endif	/* !NNTPSINK_URING_H */